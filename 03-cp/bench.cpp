@@ -0,0 +1,316 @@
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+extern "C" int cp_main(int argc, char *argv[]);
+
+static const char *source = "bench_source.bin";
+static const char *destination = "bench_destination.bin";
+
+/*
+ * System call counting. The Makefile links with -Wl,--wrap=NAME for every
+ * system call wrapper cp.o uses, which sends its calls through the
+ * __wrap_NAME functions below. Calls made by the kernel on our behalf (the
+ * io_uring workers) are not counted, which is the point of io_uring.
+ */
+
+static std::atomic<long> syscalls(0);
+
+#define WRAP(ret, name, params, args)                   \
+    extern "C" ret __real_##name params;                \
+    extern "C" ret __wrap_##name params                 \
+    {                                                   \
+        syscalls.fetch_add(1, std::memory_order_relaxed); \
+        return __real_##name args;                      \
+    }
+
+/*
+ * Device emulation for BM_Devices. While a rate is set, every read and
+ * write takes as long as it would on a device of that speed which serves
+ * one request at a time. The wait is a sleep, so the CPU is free for the
+ * other side of the copy, as it would be with real devices.
+ */
+
+struct Device {
+    std::atomic<double> rate{0};    // bytes per second, 0 to disable
+    std::mutex lock;
+    std::chrono::steady_clock::time_point idle;
+};
+
+static Device source_device, destination_device;
+
+static void device_wait(Device &device, ssize_t n)
+{
+    std::chrono::steady_clock::time_point done;
+    double rate = device.rate;
+
+    if (rate <= 0 || n <= 0)
+        return;
+    {
+        std::lock_guard<std::mutex> guard(device.lock);
+        device.idle = std::max(device.idle, std::chrono::steady_clock::now()) +
+                      std::chrono::nanoseconds((long long) (n / rate * 1e9));
+        done = device.idle;
+    }
+    std::this_thread::sleep_until(done);
+}
+
+#define WRAP_IO(ret, name, device, params, args)        \
+    extern "C" ret __real_##name params;                \
+    extern "C" ret __wrap_##name params                 \
+    {                                                   \
+        syscalls.fetch_add(1, std::memory_order_relaxed); \
+        ret done = __real_##name args;                  \
+        device_wait(device, done);                      \
+        return done;                                    \
+    }
+
+WRAP_IO(ssize_t, read, source_device, (int fd, void *buf, size_t n), (fd, buf, n))
+WRAP_IO(ssize_t, write, destination_device, (int fd, const void *buf, size_t n), (fd, buf, n))
+WRAP_IO(ssize_t, pread, source_device, (int fd, void *buf, size_t n, off_t off), (fd, buf, n, off))
+WRAP_IO(ssize_t, pwrite, destination_device, (int fd, const void *buf, size_t n, off_t off),
+        (fd, buf, n, off))
+WRAP(int, openat, (int dirfd, const char *path, int flags, mode_t mode), (dirfd, path, flags, mode))
+WRAP(int, close, (int fd), (fd))
+WRAP(int, fstat, (int fd, struct stat *st), (fd, st))
+WRAP(int, fstatat, (int dirfd, const char *path, struct stat *st, int flags), (dirfd, path, st, flags))
+WRAP(int, statx, (int dirfd, const char *path, int flags, unsigned int mask, struct statx *stx),
+     (dirfd, path, flags, mask, stx))
+WRAP(off_t, lseek, (int fd, off_t off, int whence), (fd, off, whence))
+WRAP(ssize_t, copy_file_range, (int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t n,
+                                unsigned int flags), (fd_in, off_in, fd_out, off_out, n, flags))
+WRAP(ssize_t, sendfile, (int out, int in, off_t *off, size_t n), (out, in, off, n))
+WRAP(void *, mmap, (void *addr, size_t n, int prot, int flags, int fd, off_t off),
+     (addr, n, prot, flags, fd, off))
+WRAP(int, munmap, (void *addr, size_t n), (addr, n))
+WRAP(int, madvise, (void *addr, size_t n, int advice), (addr, n, advice))
+WRAP(int, fallocate, (int fd, int mode, off_t off, off_t n), (fd, mode, off, n))
+WRAP(int, ftruncate, (int fd, off_t n), (fd, n))
+WRAP(int, fdatasync, (int fd), (fd))
+WRAP(int, posix_fadvise, (int fd, off_t off, off_t n, int advice), (fd, off, n, advice))
+WRAP(ssize_t, readahead, (int fd, off64_t off, size_t n), (fd, off, n))
+WRAP(int, sync_file_range, (int fd, off64_t off, off64_t n, unsigned int flags), (fd, off, n, flags))
+WRAP(int, fcntl, (int fd, int cmd, long arg), (fd, cmd, arg))
+WRAP(int, ioctl, (int fd, unsigned long request, void *arg), (fd, request, arg))
+WRAP(int, unlinkat, (int dirfd, const char *path, int flags), (dirfd, path, flags))
+WRAP(long, syscall, (long n, long a1, long a2, long a3, long a4, long a5, long a6),
+     (n, a1, a2, a3, a4, a5, a6))
+
+// Copy strategies to compare, as extra cp options
+struct Strategy {
+    const char *name;
+    std::vector<const char *> options;
+};
+
+static const Strategy strategies[] = {
+    {"auto", {"--reflink=never"}},
+    {"copy_file_range", {"--reflink=never", "--strategy=copy_file_range"}},
+    {"sendfile", {"--reflink=never", "--strategy=sendfile"}},
+    {"read_write/1K", {"--reflink=never", "--strategy=read_write", "--buffer-size=1K"}},
+    {"read_write/4K", {"--reflink=never", "--strategy=read_write", "--buffer-size=4K"}},
+    {"read_write/64K", {"--reflink=never", "--strategy=read_write", "--buffer-size=64K"}},
+    {"read_write/1M", {"--reflink=never", "--strategy=read_write", "--buffer-size=1M"}},
+    {"mmap", {"--reflink=never", "--strategy=mmap"}},
+    {"direct", {"--reflink=never", "--strategy=direct"}},
+    {"io_uring/qd1", {"--reflink=never", "--strategy=io_uring", "--queue-depth=1"}},
+    {"io_uring/qd4", {"--reflink=never", "--strategy=io_uring", "--queue-depth=4"}},
+    {"io_uring/qd16", {"--reflink=never", "--strategy=io_uring", "--queue-depth=16"}},
+    {"io_uring/qd64", {"--reflink=never", "--strategy=io_uring", "--queue-depth=64"}},
+    {"threads/j1", {"--reflink=never", "--strategy=threads", "-j", "1"}},
+    {"threads/j4", {"--reflink=never", "--strategy=threads", "-j", "4"}},
+    {"threads/j16", {"--reflink=never", "--strategy=threads", "-j", "16"}},
+    {"stream", {"--reflink=never", "--strategy=stream"}},
+    {"pipeline", {"--reflink=never", "--strategy=pipeline"}},
+    {"resume", {"--reflink=never", "--resume"}},
+};
+
+// 4 KiB to 4 GiB; CP_BENCH_MAX_SIZE (in bytes) cuts the sweep short
+static const int64_t sizes[] = {
+    4 << 10, 64 << 10, 1 << 20, 16 << 20, 256 << 20, 1LL << 30, 4LL << 30
+};
+
+// Only rewrite the source when the size changes, the big ones take a while
+static void create_source(int64_t size)
+{
+    static int64_t current = -1;
+    std::vector<char> buffer(1 << 20);
+    FILE *fp;
+
+    if (size == current)
+        return;
+
+    for (size_t i = 0; i < buffer.size(); i++)
+        buffer[i] = (char) (i * 131 + (i >> 12));
+
+    fp = fopen(source, "wb");
+    for (int64_t done = 0; fp != nullptr && done < size; done += buffer.size()) {
+        fwrite(buffer.data(), 1, std::min((int64_t) buffer.size(), size - done), fp);
+    }
+    if (fp != nullptr) {
+        fflush(fp);
+        fsync(fileno(fp));
+        fclose(fp);
+    }
+    current = size;
+}
+
+// Write back and evict a file, so the next copy reads it from the disk
+static void drop_cache(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static double cpu_ms(const struct timeval &tv)
+{
+    return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+// Args: file size, 1 to start every copy with a cold page cache
+static void BM_Copy(benchmark::State &state, const Strategy &strategy)
+{
+    int64_t size = state.range(0);
+    bool cold = state.range(1) != 0;
+    std::vector<const char *> argv = {"cp"};
+    struct rusage before, after;
+    double user = 0, sys = 0;
+    long calls = 0;
+
+    argv.insert(argv.end(), strategy.options.begin(), strategy.options.end());
+    argv.push_back(source);
+    argv.push_back(destination);
+    argv.push_back(nullptr);
+
+    create_source(size);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        remove(destination);
+        if (cold)
+            drop_cache(source);
+        syscalls = 0;
+        getrusage(RUSAGE_SELF, &before);
+        state.ResumeTiming();
+
+        if (cp_main(argv.size() - 1, const_cast<char **>(argv.data())) != 0) {
+            state.SkipWithError("cp failed");
+            break;
+        }
+        getrusage(RUSAGE_SELF, &after);
+        calls += syscalls;
+        user += cpu_ms(after.ru_utime) - cpu_ms(before.ru_utime);
+        sys += cpu_ms(after.ru_stime) - cpu_ms(before.ru_stime);
+    }
+
+    // Everything in the JSON output is per copy, bytes_per_second aside
+    state.SetBytesProcessed(int64_t(state.iterations()) * size);
+    state.counters["MB/s"] = benchmark::Counter(double(state.iterations()) * size / 1e6,
+                                                benchmark::Counter::kIsRate);
+    state.counters["syscalls"] = benchmark::Counter(calls, benchmark::Counter::kAvgIterations);
+    state.counters["user_ms"] = benchmark::Counter(user, benchmark::Counter::kAvgIterations);
+    state.counters["sys_ms"] = benchmark::Counter(sys, benchmark::Counter::kAvgIterations);
+    remove(destination);
+}
+
+// Args: MB/s of the emulated source and destination devices. A copy that
+// takes turns runs at 1 / (1 / read + 1 / write), one that overlaps the
+// two at min(read, write); both are reported next to the measured rate.
+static void BM_Devices(benchmark::State &state, const Strategy &strategy)
+{
+    const int64_t size = 64 << 20;
+    double read_rate = state.range(0) * 1e6, write_rate = state.range(1) * 1e6;
+    std::vector<const char *> argv = {"cp"};
+
+    argv.insert(argv.end(), strategy.options.begin(), strategy.options.end());
+    argv.push_back(source);
+    argv.push_back(destination);
+    argv.push_back(nullptr);
+
+    create_source(size);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        remove(destination);
+        source_device.rate = read_rate;
+        destination_device.rate = write_rate;
+        state.ResumeTiming();
+
+        int ret = cp_main(argv.size() - 1, const_cast<char **>(argv.data()));
+
+        source_device.rate = 0;
+        destination_device.rate = 0;
+        if (ret != 0) {
+            state.SkipWithError("cp failed");
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(int64_t(state.iterations()) * size);
+    state.counters["MB/s"] = benchmark::Counter(double(state.iterations()) * size / 1e6,
+                                                benchmark::Counter::kIsRate);
+    state.counters["serial_MB/s"] = 1e-6 / (1 / read_rate + 1 / write_rate);
+    state.counters["overlap_MB/s"] = std::min(read_rate, write_rate) / 1e6;
+    remove(destination);
+}
+
+static const Strategy device_strategies[] = {
+    {"read_write/1M", {"--reflink=never", "--strategy=read_write", "--buffer-size=1M"}},
+    {"pipeline", {"--reflink=never", "--strategy=pipeline"}},
+};
+
+static int register_benchmarks()
+{
+    const char *max = getenv("CP_BENCH_MAX_SIZE");
+    int64_t max_size = (max != nullptr) ? strtoll(max, nullptr, 10) : sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+
+    // Sizes outermost, so the source is written once per size
+    for (int64_t size : sizes) {
+        if (size > max_size)
+            break;
+        for (const Strategy &strategy : strategies) {
+            benchmark::RegisterBenchmark((std::string("BM_Copy/") + strategy.name).c_str(),
+                                         BM_Copy, strategy)
+                ->ArgNames({"size", "cold"})
+                ->Args({size, 0})->Args({size, 1})
+                ->Unit(benchmark::kMillisecond)->UseRealTime()->MeasureProcessCPUTime();
+        }
+    }
+
+    for (const Strategy &strategy : device_strategies) {
+        benchmark::RegisterBenchmark((std::string("BM_Devices/") + strategy.name).c_str(),
+                                     BM_Devices, strategy)
+            ->ArgNames({"read_mbps", "write_mbps"})
+            ->Args({400, 400})->Args({400, 100})->Args({100, 400})
+            ->Unit(benchmark::kMillisecond)->UseRealTime();
+    }
+    return 0;
+}
+
+static int registered = register_benchmarks();
+
+int main(int argc, char **argv)
+{
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    remove(source);
+    return 0;
+}
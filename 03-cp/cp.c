@@ -1,47 +1,4049 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <linux/fs.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <linux/magic.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 
-#define BUFSIZE 1024
+#define BUFSIZE 1024            // default buffer of the read()/write() loop
+#define MAX_BUFSIZE (64 << 20)
+#define CHUNKSIZE (1 << 30)     // max bytes handed to the kernel per call
+#define DIRECT_BUFSIZE (1 << 20) // O_DIRECT transfer size, rounded to the alignment
+#define MMAP_WINDOW (64 << 20)  // how much of the source is mapped at a time
+#define URING_BUFSIZE (256 << 10) // size of each registered io_uring buffer
+#define URING_DEPTH 16          // default number of chunks in flight
+#define MAX_URING_DEPTH 1024
+#define THREAD_CHUNK (8 << 20)  // unit of work for the threads strategy
+#define THREAD_BUFSIZE (1 << 20)
+#define PIPELINE_BUFSIZE (1 << 20) // size of each buffer between the reader and the writer thread
+#define PIPELINE_SLOTS 4        // buffers in the ring, a power of two
+#define PIPELINE_SPIN 1000      // polls of the other side's index before sleeping
+#define STREAM_WINDOW (8 << 20) // readahead and cache dropping unit of the stream strategy
+#define PREALLOC_MIN (64 << 10) // smaller files get their blocks from a single write
+#define TINY_FILE (16 << 10)    // files up to this size are copied with one read() and one write()
+#define CHECKSUM_BUFSIZE (1 << 20)
+#define DELTA_BLOCK (64 << 10)  // unit of comparison for --incremental
+#define RESUME_INTERVAL (64 << 20) // bytes copied between two --resume checkpoints
+#define UPDATE_SAMPLES 16       // blocks compared by --update=sample
+#define UPDATE_SAMPLE_SIZE 4096
+#define JOURNAL_SUFFIX ".cp-journal"
+#define JOURNAL_MAGIC 0x4a4e5243u  // "CRNJ"
+#define TO_EOF ((off_t) 0x7fffffffffffffffLL)
 
-int cp_main(int argc, char *argv[])
+#define MAX_JOBS 256
+
+#define FAN_OUT_BUFSIZE (1 << 20) // unit read once and written to every --fan-out destination
+#define FAN_OUT_SLOTS 8         // chunks the fastest destination may be ahead of the slowest
+#define MAX_FAN_OUT 64
+#define SPLICE_CHUNK (1 << 20)  // bytes asked of each splice(), and the size of its pipe
+#define SMALL_FILE (1 << 20)    // size classes of the strategy table
+#define LARGE_FILE (64 << 20)
+#define MAX_TUNING 64           // rows a calibration cache may hold
+#define CALIBRATION_RUNS 3      // copies timed per strategy and size, the best one counts
+#define TUNING_FILE "cp-tuning"
+#define LIMIT_SLICE (1 << 20)   // largest single write or transfer under --bwlimit/--iops
+#define LIMIT_MIN_BURST (64 << 10)
+#define STATS_BUCKETS 32        // latency histogram buckets, powers of two from 1 us
+
+#define ROUND_UP(x, align) (((x) + (align) - 1) / (align) * (align))
+
+// Result of a copy attempt
+#define COPY_DONE      0
+#define COPY_ERROR    -1
+#define COPY_FALLBACK  1        // not supported here, finish with the next method
+
+typedef enum {
+    SPARSE_AUTO,        // keep holes if the source looks sparse
+    SPARSE_ALWAYS,      // always walk the data extents of the source
+    SPARSE_NEVER        // write holes out as zeros
+} SparseMode;
+
+typedef enum {
+    REFLINK_AUTO,       // clone if the file system can, copy otherwise
+    REFLINK_ALWAYS,     // fail if the data cannot be cloned
+    REFLINK_NEVER       // always copy the data
+} ReflinkMode;
+
+typedef enum {
+    UPDATE_NONE,        // always copy
+    UPDATE_QUICK,       // skip destinations with the size and mtime of the source
+    UPDATE_SAMPLE       // same, but also compare a few blocks before skipping
+} UpdateMode;
+
+// How the data is copied when it is not cloned, picked with --strategy
+typedef enum {
+    STRATEGY_AUTO,          // copy_file_range, then sendfile, then read/write
+    STRATEGY_COPY_RANGE,
+    STRATEGY_SENDFILE,
+    STRATEGY_READ_WRITE,
+    STRATEGY_MMAP,
+    STRATEGY_DIRECT,
+    STRATEGY_IO_URING,
+    STRATEGY_THREADS,
+    STRATEGY_STREAM,
+    STRATEGY_PIPELINE,
+    STRATEGY_COUNT
+} Strategy;
+
+static const char *strategy_names[STRATEGY_COUNT] = {
+    "auto", "copy_file_range", "sendfile", "read_write", "mmap", "direct", "io_uring",
+    "threads", "stream", "pipeline"
+};
+
+// Size classes of the strategy table
+typedef enum {
+    SIZE_SMALL,         // under SMALL_FILE
+    SIZE_MEDIUM,        // under LARGE_FILE
+    SIZE_LARGE,
+    SIZE_CLASSES        // any size, in the built-in table
+} SizeClass;
+
+static const char *size_names[SIZE_CLASSES] = {"small", "medium", "large"};
+
+// A row of the table --strategy=auto picks the copy strategy from
+struct tuning {
+    unsigned long fs_type;      // f_type of the destination, 0 for any
+    int same_device;            // source on the same device, -1 for either
+    SizeClass size;
+    Strategy strategy;
+};
+
+// Rows written by cp --calibrate, looked up before the built-in ones
+struct tuning_table {
+    struct tuning rows[MAX_TUNING];
+    int count;
+};
+
+// Ways the data can end up in the destination, reported by --verbose
+typedef enum {
+    METHOD_CLONE,
+    METHOD_COPY_RANGE,
+    METHOD_SENDFILE,
+    METHOD_READ_WRITE,
+    METHOD_MMAP,
+    METHOD_DIRECT,
+    METHOD_IO_URING,
+    METHOD_THREADS,
+    METHOD_STREAM,
+    METHOD_DELTA,
+    METHOD_SPLICE,
+    METHOD_FAN_OUT,
+    METHOD_PIPELINE,
+    METHOD_COUNT
+} CopyMethod;
+
+static const char *method_names[METHOD_COUNT] = {
+    "clone", "copy_file_range", "sendfile", "read/write", "mmap", "direct", "io_uring",
+    "threads", "stream", "delta", "splice", "fan-out", "pipeline"
+};
+
+struct cp_options {
+    SparseMode sparse;
+    ReflinkMode reflink;
+    Strategy strategy;
+    int recursive;
+    int jobs;           // worker threads for -r and the threads strategy
+    int queue_depth;    // chunks in flight for io_uring
+    size_t buffer_size; // buffer of the read()/write() loop
+    int checksum;       // print the CRC32C of the data
+    int verify;         // read the destination back and compare checksums
+    int expect_set;     // fail unless the data has the CRC32C in expect
+    uint32_t expect;
+    int incremental;    // only rewrite the blocks of the destination that differ
+    int resume;         // checkpoint progress to a journal and continue from it
+    UpdateMode update;  // skip unchanged destinations, and stamp the ones copied
+    int fan_out;        // one source, every other argument is a destination
+    int atomic;         // write to an unnamed file and swap it in when complete
+    int sync;           // fdatasync() each copy before it counts as done
+    int verbose;
+    unsigned long long bwlimit; // bytes per second, 0 for no limit
+    unsigned long long iops;    // writes per second, 0 for no limit
+    unsigned long long burst;   // bytes that may go at full speed, 0 for the default
+    struct rate_limit *limit;   // the token bucket, when either limit is set
+    int report_stats;           // --stats
+    const char *stats_file;     // where the stats go, stderr when NULL
+    struct copy_stats *stats;   // the counters, when report_stats is set
+    const struct tuning_table *tuning; // the calibrated strategies, NULL to not tune at all
+    int calibrate;              // time the strategies and update the tuning file
+};
+
+// One source/destination pair being copied
+struct copy_job {
+    int fd_src;
+    int fd_dest;
+    const struct cp_options *opts;
+    unsigned int methods;       // bit per CopyMethod that moved data
+    int no_clone;               // a clone failed, don't try again
+    uint32_t crc;               // CRC32C of the data, when checksumming
+    off_t rewritten;            // bytes written by an incremental copy
+    int fd_journal;             // progress journal for --resume, or -1
+    off_t resumed;              // offset a resumed copy continued from
+    Strategy strategy;          // opts->strategy, or what the table picked for auto
+    const char *picked_by;      // "built-in" or "calibrated" when the table picked it
+};
+
+static const char usage_msg[] =
+    "Usage: cp [-rv] [-j jobs] [--sparse=auto|always|never] [--reflink[=auto|always|never]]\n"
+    "          [--strategy=NAME] [--direct] [--queue-depth=N] [--buffer-size=N[K|M]]\n"
+    "          [--checksum] [--verify] [--expect=CRC32C] [--incremental] [--resume]\n"
+    "          [-u|--update[=quick|sample]] [--atomic] [--sync]\n"
+    "          [--bwlimit=BYTES[K|M|G]] [--iops=N] [--burst=BYTES[K|M|G]]\n"
+    "          [--stats[=FILE]] <source> <destination>\n"
+    "   or: cp [OPTION]... <source>... <directory>\n"
+    "   or: cp [OPTION]... --fan-out <source> <destination>...\n"
+    "   or: cp [-v] --calibrate <source directory> <destination directory>\n"
+    "A <source> or <destination> of - means stdin or stdout.\n"
+    "Strategies: auto, copy_file_range, sendfile, read_write, mmap, direct, io_uring,\n"
+    "            threads, stream, pipeline\n"
+    "auto picks one by file system and size, see --calibrate; the results are kept\n"
+    "in $CP_TUNING_FILE, or else $XDG_CACHE_HOME/" TUNING_FILE " or ~/.cache/" TUNING_FILE ".\n";
+
+// The in-kernel methods below use (and advance) the file offsets, so when one
+// of them gives up half way the next method simply continues from there.
+// Each one copies until *len bytes are done or the source hits EOF, and
+// subtracts what it copied from *len.
+
+static int unsupported(int err)
+{
+    return err == ENOSYS || err == EXDEV || err == EINVAL ||
+           err == EOPNOTSUPP || err == ENOTSUP;
+}
+
+static size_t chunk(off_t len, size_t max)
+{
+    return (len < (off_t) max) ? (size_t) len : max;
+}
+
+static void *alloc_aligned(size_t size, size_t align)
+{
+    void *buffer;
+
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+
+    return (posix_memalign(&buffer, align, size) == 0) ? buffer : NULL;
+}
+
+/*
+ * CRC32C (Castagnoli). x86-64 CPUs with SSE4.2 have an instruction for it
+ * that does 8 bytes at a time; everything else uses a table, one byte at a
+ * time. The implementation is picked on first use.
+ */
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *data, size_t len)
+{
+    crc = ~crc;
+    while (len--)
+        crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *data, size_t len)
+{
+    uint64_t crc64 = ~crc;
+
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+    }
+
+    crc = (uint32_t) crc64;
+    while (len--)
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+    return ~crc;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t, const unsigned char *, size_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        crc32c_table[i] = crc;
+    }
+
+    crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_impl = crc32c_hw;
+#endif
+}
+
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_impl(crc, data, len);
+}
+
+/*
+ * --stats: counters for the system calls that move data, shared by all the
+ * copies of one run (and so by the worker threads, hence the atomics).
+ * Transfers are the calls that read and write in one go in the kernel:
+ * copy_file_range(), sendfile() and clones.
+ */
+
+typedef enum {
+    CALL_READ,
+    CALL_WRITE,
+    CALL_TRANSFER,
+    CALL_KINDS
+} CallKind;
+
+static const char *call_names[CALL_KINDS] = {"read", "write", "transfer"};
+
+struct call_stats {
+    unsigned long long calls;
+    unsigned long long short_calls;     // moved less than asked for, but not nothing
+    unsigned long long bytes;
+    unsigned long long ns;
+    unsigned long long latency[STATS_BUCKETS]; // bucket i: less than 2^i us
+};
+
+struct copy_stats {
+    struct call_stats calls[CALL_KINDS];
+    unsigned long long files;
+    unsigned long long bytes;
+    unsigned long long skipped;         // left alone by --update
+    unsigned int methods;
+};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Start time of a call, only read when stats are on
+static long long stats_begin(const struct cp_options *opts)
+{
+    return opts->stats ? now_ns() : 0;
+}
+
+static void stats_record(const struct cp_options *opts, CallKind kind, long long ns,
+                         ssize_t n, size_t want)
+{
+    struct call_stats *cs;
+    int bucket = 0;
+
+    if (opts->stats == NULL)
+        return;
+
+    cs = &opts->stats->calls[kind];
+    while (bucket < STATS_BUCKETS - 1 && ns >= 1000LL << bucket)
+        bucket++;
+
+    __atomic_add_fetch(&cs->calls, 1, __ATOMIC_RELAXED);
+    if (n > 0 && (size_t) n < want)
+        __atomic_add_fetch(&cs->short_calls, 1, __ATOMIC_RELAXED);
+    if (n > 0)
+        __atomic_add_fetch(&cs->bytes, n, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cs->ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cs->latency[bucket], 1, __ATOMIC_RELAXED);
+}
+
+static void stats_call(const struct cp_options *opts, CallKind kind, long long start,
+                       ssize_t n, size_t want)
+{
+    if (opts->stats != NULL)
+        stats_record(opts, kind, now_ns() - start, n, want);
+}
+
+/*
+ * --bwlimit and --iops: a token bucket shared by everything that writes.
+ * Bytes (and writes) flow in at the configured rate, up to burst of them
+ * can be saved up. A writer takes its tokens up front and, when that puts
+ * the bucket in debt, sleeps for exactly as long as the debt takes to
+ * repay. With writes cut into slices of at most LIMIT_SLICE this paces the
+ * copy evenly instead of sleeping for a while and then bursting.
+ */
+
+struct rate_limit {
+    pthread_mutex_t lock;
+    double rate;                // bytes per second, 0 for no limit
+    double iops;                // writes per second, 0 for no limit
+    double burst;               // bucket sizes
+    double burst_ops;
+    double tokens;              // negative when in debt
+    double op_tokens;
+    long long last;             // when the tokens were last topped up
+    size_t slice;
+};
+
+static void rate_limit_init(struct rate_limit *limit, const struct cp_options *opts)
+{
+    unsigned long long burst = opts->burst ? opts->burst : opts->bwlimit / 10;
+
+    if (burst < LIMIT_MIN_BURST)
+        burst = LIMIT_MIN_BURST;
+
+    pthread_mutex_init(&limit->lock, NULL);
+    limit->rate = opts->bwlimit;
+    limit->iops = opts->iops;
+    limit->burst = burst;
+    limit->burst_ops = (opts->iops / 10 > 1) ? opts->iops / 10 : 1;
+    limit->tokens = limit->burst;
+    limit->op_tokens = limit->burst_ops;
+    limit->last = now_ns();
+
+    // Slices stay multiples of 64 KiB, which keeps O_DIRECT writes aligned
+    limit->slice = (opts->bwlimit && burst < LIMIT_SLICE) ? burst : LIMIT_SLICE;
+    limit->slice -= limit->slice % LIMIT_MIN_BURST;
+}
+
+// Largest write or transfer to issue at once
+static size_t io_chunk(const struct cp_options *opts, size_t max)
+{
+    return (opts->limit != NULL && opts->limit->slice < max) ? opts->limit->slice : max;
+}
+
+// Take bytes tokens and one write token, and wait until they are paid for
+static void throttle(const struct cp_options *opts, size_t bytes)
+{
+    struct rate_limit *limit = opts->limit;
+    struct timespec ts;
+    double elapsed, wait = 0;
+    long long now;
+
+    if (limit == NULL)
+        return;
+
+    pthread_mutex_lock(&limit->lock);
+    now = now_ns();
+    elapsed = (now - limit->last) / 1e9;
+    limit->last = now;
+
+    if (limit->rate > 0) {
+        limit->tokens += elapsed * limit->rate;
+        if (limit->tokens > limit->burst)
+            limit->tokens = limit->burst;
+        limit->tokens -= bytes;
+        if (limit->tokens < 0)
+            wait = -limit->tokens / limit->rate;
+    }
+    if (limit->iops > 0) {
+        limit->op_tokens += elapsed * limit->iops;
+        if (limit->op_tokens > limit->burst_ops)
+            limit->op_tokens = limit->burst_ops;
+        limit->op_tokens -= 1;
+        if (limit->op_tokens < 0 && -limit->op_tokens / limit->iops > wait)
+            wait = -limit->op_tokens / limit->iops;
+    }
+    pthread_mutex_unlock(&limit->lock);
+
+    if (wait > 0) {
+        ts.tv_sec = (time_t) wait;
+        ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+// Give back the tokens of a transfer that moved less than it paid for
+static void unthrottle(const struct cp_options *opts, size_t want, ssize_t n)
+{
+    struct rate_limit *limit = opts->limit;
+    size_t unused = (n > 0) ? want - n : want;
+
+    if (limit == NULL || unused == 0 || limit->rate == 0)
+        return;
+
+    pthread_mutex_lock(&limit->lock);
+    limit->tokens += unused;
+    if (limit->tokens > limit->burst)
+        limit->tokens = limit->burst;
+    pthread_mutex_unlock(&limit->lock);
+}
+
+// The data path calls, counted for --stats
+static ssize_t job_read(struct copy_job *job, void *buffer, size_t len)
+{
+    long long start = stats_begin(job->opts);
+    ssize_t n = read(job->fd_src, buffer, len);
+
+    stats_call(job->opts, CALL_READ, start, n, len);
+    return n;
+}
+
+// write(), or pwrite() at offset unless that is negative
+static ssize_t write_once(struct copy_job *job, const void *buffer, size_t len, off_t offset)
+{
+    long long start = stats_begin(job->opts);
+    ssize_t n = (offset < 0) ? write(job->fd_dest, buffer, len)
+                             : pwrite(job->fd_dest, buffer, len, offset);
+
+    stats_call(job->opts, CALL_WRITE, start, n, len);
+    return n;
+}
+
+// Under a rate limit, write in slices that each wait for their tokens
+static ssize_t paced_write(struct copy_job *job, const void *buffer, size_t len, off_t offset)
+{
+    size_t done = 0;
+
+    if (job->opts->limit == NULL)
+        return write_once(job, buffer, len, offset);
+
+    while (done < len) {
+        size_t want = io_chunk(job->opts, len - done);
+        ssize_t n;
+
+        throttle(job->opts, want);
+        n = write_once(job, (const char *) buffer + done, want, (offset < 0) ? -1 : offset + (off_t) done);
+        unthrottle(job->opts, want, n);
+        if (n < 0)
+            return (done > 0) ? (ssize_t) done : n;
+        done += n;
+        if ((size_t) n < want)
+            break;
+    }
+    return done;
+}
+
+static ssize_t job_write(struct copy_job *job, const void *buffer, size_t len)
+{
+    return paced_write(job, buffer, len, -1);
+}
+
+static ssize_t job_pread(struct copy_job *job, void *buffer, size_t len, off_t offset)
+{
+    long long start = stats_begin(job->opts);
+    ssize_t n = pread(job->fd_src, buffer, len, offset);
+
+    stats_call(job->opts, CALL_READ, start, n, len);
+    return n;
+}
+
+static ssize_t job_pwrite(struct copy_job *job, const void *buffer, size_t len, off_t offset)
+{
+    return paced_write(job, buffer, len, offset);
+}
+
+static int copy_range(struct copy_job *job, off_t *len)
+{
+    ssize_t n = 0;
+    off_t total = 0;
+
+    while (*len > 0) {
+        size_t want = chunk(*len, io_chunk(job->opts, CHUNKSIZE));
+        long long start;
+
+        throttle(job->opts, want);
+        start = stats_begin(job->opts);
+        n = copy_file_range(job->fd_src, NULL, job->fd_dest, NULL, want, 0);
+        stats_call(job->opts, CALL_TRANSFER, start, n, want);
+        unthrottle(job->opts, want, n);
+        if (n <= 0)
+            break;
+        total += n;
+        *len -= n;
+    }
+
+    if (total > 0)
+        job->methods |= 1u << METHOD_COPY_RANGE;
+
+    if (n >= 0)
+        // procfs/sysfs files report EOF right away, let read() decide
+        return (total == 0 && *len > 0) ? COPY_FALLBACK : COPY_DONE;
+
+    return unsupported(errno) ? COPY_FALLBACK : COPY_ERROR;
+}
+
+static int copy_sendfile(struct copy_job *job, off_t *len)
+{
+    ssize_t n = 0;
+    off_t total = 0;
+
+    while (*len > 0) {
+        size_t want = chunk(*len, io_chunk(job->opts, CHUNKSIZE));
+        long long start;
+
+        throttle(job->opts, want);
+        start = stats_begin(job->opts);
+        n = sendfile(job->fd_dest, job->fd_src, NULL, want);
+        stats_call(job->opts, CALL_TRANSFER, start, n, want);
+        unthrottle(job->opts, want, n);
+        if (n <= 0)
+            break;
+        total += n;
+        *len -= n;
+    }
+
+    if (total > 0)
+        job->methods |= 1u << METHOD_SENDFILE;
+
+    if (n >= 0)
+        return (total == 0 && *len > 0) ? COPY_FALLBACK : COPY_DONE;
+
+    return unsupported(errno) ? COPY_FALLBACK : COPY_ERROR;
+}
+
+static int copy_read_write(struct copy_job *job, off_t *len)
+{
+    char stack_buffer[BUFSIZE];
+    size_t size = job->opts->buffer_size;
+    char *buffer = (size > BUFSIZE) ? alloc_aligned(size, sysconf(_SC_PAGESIZE)) : stack_buffer;
+    ssize_t bytes_read = 0, bytes_written;
+    int ret = COPY_DONE;
+
+    if (buffer == NULL)
+        return COPY_ERROR;
+
+    job->methods |= 1u << METHOD_READ_WRITE;
+
+    while (*len > 0 &&
+           (bytes_read = job_read(job, buffer, chunk(*len, size))) > 0) {
+        bytes_written = job_write(job, buffer, bytes_read);
+        if (bytes_written != bytes_read) {
+            ret = COPY_ERROR;
+            break;
+        }
+        *len -= bytes_read;
+    }
+
+    if (buffer != stack_buffer)
+        free(buffer);
+
+    return (bytes_read < 0) ? COPY_ERROR : ret;
+}
+
+// copy_file_range(), then sendfile(), then the plain read()/write() loop
+static int copy_auto(struct copy_job *job, off_t *len)
+{
+    int ret = copy_range(job, len);
+
+    if (ret == COPY_FALLBACK)
+        ret = copy_sendfile(job, len);
+
+    if (ret == COPY_FALLBACK)
+        ret = copy_read_write(job, len);
+
+    return ret;
+}
+
+// Map the source in MMAP_WINDOW sized windows and write() straight from the
+// mapping, which saves the copy into a user space buffer.
+static int copy_mmap(struct copy_job *job, off_t *len)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    struct stat st;
+    off_t offset;
+
+    if (fstat(job->fd_src, &st) < 0 || !S_ISREG(st.st_mode))
+        return COPY_FALLBACK;
+
+    offset = lseek(job->fd_src, 0, SEEK_CUR);
+    if (offset < 0)
+        return COPY_FALLBACK;
+
+    job->methods |= 1u << METHOD_MMAP;
+
+    while (*len > 0 && offset < st.st_size) {
+        off_t start = offset / page * page;     // mmap offsets are page aligned
+        size_t skip = offset - start;
+        size_t count = chunk(st.st_size - offset, MMAP_WINDOW - skip);
+        char *map;
+
+        count = chunk(*len, count);
+
+        map = mmap(NULL, skip + count, PROT_READ, MAP_SHARED, job->fd_src, start);
+        if (map == MAP_FAILED)
+            return COPY_ERROR;
+        madvise(map, skip + count, MADV_SEQUENTIAL);
+
+        for (size_t done = 0; done < count; ) {
+            ssize_t n = job_write(job, map + skip + done, count - done);
+            if (n <= 0) {
+                munmap(map, skip + count);
+                return COPY_ERROR;
+            }
+            done += n;
+        }
+
+        munmap(map, skip + count);
+        offset += count;
+        *len -= count;
+    }
+
+    // Keep the offset contract of the other methods
+    if (lseek(job->fd_src, offset, SEEK_SET) < 0)
+        return COPY_ERROR;
+
+    return COPY_DONE;
+}
+
+/*
+ * io_uring backend, on raw system calls so liburing is not needed.
+ *
+ * Each of the queue_depth slots owns a registered (fixed) buffer and carries
+ * one chunk as a READ_FIXED linked to a WRITE_FIXED, so the kernel starts the
+ * write as soon as the read is done and chunk N + 1 is read while chunk N is
+ * written. Whenever a write completes its slot takes the next chunk.
+ */
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned to_submit;
+};
+
+struct uring_slot {
+    char *buffer;
+    off_t offset;           // offset of the chunk in both files
+    size_t len;
+    int read_res;
+    long long queued;       // when the read (then the write) started, for --stats
+};
+
+static int uring_setup(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+        return -1;
+
+    ring->sq_head = (unsigned *) ((char *) ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) ((char *) ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) ((char *) ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown(struct uring *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+}
+
+static void uring_queue(struct uring *ring, int opcode, int fd, struct uring_slot *slot,
+                        int buf_index, unsigned flags, __u64 user_data)
+{
+    unsigned tail = *ring->sq_tail;     // only we write the tail
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = flags;
+    sqe->fd = fd;
+    sqe->addr = (__u64) (unsigned long) slot->buffer;
+    sqe->len = slot->len;
+    sqe->off = slot->offset;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+static int uring_enter(struct uring *ring, unsigned min_complete)
+{
+    int ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        return -1;
+    ring->to_submit -= ret;
+    return 0;
+}
+
+// Copy a chunk whose linked read and write did not both complete in full
+static int uring_finish_slot(struct copy_job *job, struct uring_slot *slot, off_t *eof)
+{
+    size_t done = 0;
+
+    if (slot->read_res < 0 && slot->read_res != -ECANCELED &&
+        !unsupported(-slot->read_res)) {
+        errno = -slot->read_res;
+        return -1;
+    }
+
+    // Whatever was read is still in the buffer
+    if (slot->read_res > 0) {
+        done = slot->read_res;
+        if (job_pwrite(job, slot->buffer, done, slot->offset) != (ssize_t) done)
+            return -1;
+    }
+
+    while (done < slot->len) {
+        ssize_t n = job_pread(job, slot->buffer, slot->len - done, slot->offset + done);
+        if (n < 0)
+            return -1;
+        if (n == 0) {                   // the source got shorter
+            if (slot->offset + (off_t) done < *eof)
+                *eof = slot->offset + done;
+            break;
+        }
+        if (job_pwrite(job, slot->buffer, n, slot->offset + done) != n)
+            return -1;
+        done += n;
+    }
+
+    return 0;
+}
+
+static int copy_uring(struct copy_job *job, off_t *len)
+{
+    unsigned depth = job->opts->queue_depth;
+    struct uring_slot slots[MAX_URING_DEPTH];
+    struct iovec iovecs[MAX_URING_DEPTH];
+    struct uring ring;
+    struct stat st;
+    off_t start, next, end, eof;
+    unsigned outstanding = 0, i;    // submitted requests without a completion
+    char *buffers = NULL;
+    int failed = 0;
+
+    if (fstat(job->fd_src, &st) < 0 || !S_ISREG(st.st_mode))
+        return COPY_FALLBACK;
+
+    start = lseek(job->fd_src, 0, SEEK_CUR);
+    next = lseek(job->fd_dest, 0, SEEK_CUR);
+    if (start < 0 || next != start)
+        return COPY_FALLBACK;
+
+    end = (st.st_size - start < *len) ? st.st_size : start + *len;
+    if (end <= start)
+        return COPY_FALLBACK;
+    eof = end;
+
+    // No point in setting up more buffers than there are chunks
+    if ((off_t) depth * URING_BUFSIZE > end - start)
+        depth = (end - start + URING_BUFSIZE - 1) / URING_BUFSIZE;
+
+    // Old kernels, seccomp filters and kernel.io_uring_disabled land here
+    if (uring_setup(&ring, 2 * depth) < 0) {
+        uring_teardown(&ring);
+        return COPY_FALLBACK;
+    }
+
+    buffers = alloc_aligned((size_t) depth * URING_BUFSIZE, sysconf(_SC_PAGESIZE));
+    if (buffers == NULL) {
+        uring_teardown(&ring);
+        return COPY_FALLBACK;
+    }
+    for (i = 0; i < depth; i++) {
+        slots[i].buffer = buffers + (size_t) i * URING_BUFSIZE;
+        iovecs[i].iov_base = slots[i].buffer;
+        iovecs[i].iov_len = URING_BUFSIZE;
+    }
+
+    // Registering can fail on a low RLIMIT_MEMLOCK
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iovecs, depth) < 0) {
+        uring_teardown(&ring);
+        free(buffers);
+        return COPY_FALLBACK;
+    }
+
+    job->methods |= 1u << METHOD_IO_URING;
+
+    for (i = 0; i < depth && next < end; i++) {
+        slots[i].offset = next;
+        slots[i].len = chunk(end - next, URING_BUFSIZE);
+        slots[i].read_res = -ECANCELED;
+        throttle(job->opts, slots[i].len);
+        slots[i].queued = stats_begin(job->opts);
+        next += slots[i].len;
+        uring_queue(&ring, IORING_OP_READ_FIXED, job->fd_src, &slots[i], i, IOSQE_IO_LINK, 2 * i);
+        uring_queue(&ring, IORING_OP_WRITE_FIXED, job->fd_dest, &slots[i], i, 0, 2 * i + 1);
+        outstanding += 2;
+    }
+
+    while (outstanding > 0) {
+        unsigned head, tail;
+
+        if (uring_enter(&ring, 1) < 0) {
+            failed = 1;
+            break;
+        }
+
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            struct uring_slot *slot = &slots[cqe->user_data / 2];
+
+            outstanding--;
+
+            // Latencies are as seen from here, so they include waiting to be reaped
+            if (job->opts->stats != NULL) {
+                long long now = now_ns();
+                stats_record(job->opts, (cqe->user_data % 2 == 0) ? CALL_READ : CALL_WRITE,
+                             now - slot->queued, cqe->res, slot->len);
+                slot->queued = now;
+            }
+
+            if (cqe->user_data % 2 == 0) {
+                slot->read_res = cqe->res;
+                continue;
+            }
+
+            // The write ends the chunk, see if it went all the way
+            if ((cqe->res < 0 || (size_t) cqe->res != slot->len) &&
+                uring_finish_slot(job, slot, &eof) < 0)
+                failed = 1;
+
+            // After a failure only drain what is in flight
+            if (!failed && next < eof) {
+                slot->offset = next;
+                slot->len = chunk(end - next, URING_BUFSIZE);
+                slot->read_res = -ECANCELED;
+                throttle(job->opts, slot->len);
+                slot->queued = stats_begin(job->opts);
+                next += slot->len;
+                uring_queue(&ring, IORING_OP_READ_FIXED, job->fd_src, slot, slot - slots,
+                            IOSQE_IO_LINK, cqe->user_data - 1);
+                uring_queue(&ring, IORING_OP_WRITE_FIXED, job->fd_dest, slot, slot - slots,
+                            0, cqe->user_data);
+                outstanding += 2;
+            }
+        }
+
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    uring_teardown(&ring);
+
+    // If we could not wait for the kernel it may still use the buffers
+    if (outstanding == 0)
+        free(buffers);
+
+    if (failed)
+        return COPY_ERROR;
+
+    if (eof < end && ftruncate(job->fd_dest, eof) < 0)
+        return COPY_ERROR;
+
+    // Keep the offset contract of the other methods
+    if (lseek(job->fd_src, eof, SEEK_SET) < 0 || lseek(job->fd_dest, eof, SEEK_SET) < 0)
+        return COPY_ERROR;
+
+    *len -= eof - start;
+    return COPY_DONE;
+}
+
+/*
+ * Threads strategy: the range is cut into THREAD_CHUNK pieces that -j threads
+ * claim one after the other and copy with pread()/pwrite() at their own
+ * offsets, so a single large file gets as many requests in flight as the
+ * device can take.
+ */
+
+struct chunk_copy {
+    struct copy_job *job;
+    off_t next;             // start of the next unclaimed chunk
+    off_t end;
+    off_t eof;              // where the source turned out to end, if earlier
+    int failed;
+    pthread_mutex_t lock;
+};
+
+static void *chunk_worker(void *arg)
+{
+    struct chunk_copy *cc = arg;
+    char *buffer = alloc_aligned(THREAD_BUFSIZE, sysconf(_SC_PAGESIZE));
+    off_t offset, end;
+
+    for (;;) {
+        pthread_mutex_lock(&cc->lock);
+        offset = cc->next;
+        end = (cc->end - offset < THREAD_CHUNK) ? cc->end : offset + THREAD_CHUNK;
+        cc->next = end;
+        pthread_mutex_unlock(&cc->lock);
+
+        if (buffer == NULL)
+            __atomic_store_n(&cc->failed, 1, __ATOMIC_SEQ_CST);
+
+        if (offset >= end || __atomic_load_n(&cc->failed, __ATOMIC_SEQ_CST))
+            break;
+
+        while (offset < end) {
+            ssize_t n = job_pread(cc->job, buffer, chunk(end - offset, THREAD_BUFSIZE), offset);
+
+            if (n < 0) {
+                __atomic_store_n(&cc->failed, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            if (n == 0) {                       // the source got shorter
+                pthread_mutex_lock(&cc->lock);
+                if (offset < cc->eof)
+                    cc->eof = offset;
+                pthread_mutex_unlock(&cc->lock);
+                break;
+            }
+            if (job_pwrite(cc->job, buffer, n, offset) != n) {
+                __atomic_store_n(&cc->failed, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            offset += n;
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static int copy_threads(struct copy_job *job, off_t *len)
+{
+    pthread_t threads[MAX_JOBS];
+    struct chunk_copy cc = {
+        .job = job,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+    };
+    struct stat st, st_dest;
+    off_t start;
+    int nthreads = job->opts->jobs, started;
+
+    // Devices such as /dev/null can seek, but cannot be given a size
+    if (fstat(job->fd_src, &st) < 0 || !S_ISREG(st.st_mode) ||
+        fstat(job->fd_dest, &st_dest) < 0 || !S_ISREG(st_dest.st_mode))
+        return COPY_FALLBACK;
+
+    start = lseek(job->fd_src, 0, SEEK_CUR);
+    if (start < 0 || lseek(job->fd_dest, 0, SEEK_CUR) != start)
+        return COPY_FALLBACK;
+
+    cc.next = start;
+    cc.end = (st.st_size - start < *len) ? st.st_size : start + *len;
+    cc.eof = cc.end;
+    if (cc.end <= start)
+        return COPY_FALLBACK;
+
+    // Give the destination its final size first so the threads write into
+    // allocated blocks instead of racing to extend the file
+    if (fallocate(job->fd_dest, 0, start, cc.end - start) < 0 &&
+        ftruncate(job->fd_dest, cc.end) < 0)
+        return COPY_ERROR;
+
+    if ((cc.end - start + THREAD_CHUNK - 1) / THREAD_CHUNK < nthreads)
+        nthreads = (cc.end - start + THREAD_CHUNK - 1) / THREAD_CHUNK;
+
+    job->methods |= 1u << METHOD_THREADS;
+
+    // The calling thread takes part; chunks are claimed, so a thread that
+    // fails to start just leaves more work for the others
+    for (started = 0; started < nthreads - 1; started++) {
+        if (pthread_create(&threads[started], NULL, chunk_worker, &cc) != 0)
+            break;
+    }
+    chunk_worker(&cc);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&cc.lock);
+
+    if (cc.failed)
+        return COPY_ERROR;
+
+    if (cc.eof < cc.end && ftruncate(job->fd_dest, cc.eof) < 0)
+        return COPY_ERROR;
+
+    // Keep the offset contract of the other methods
+    if (lseek(job->fd_src, cc.eof, SEEK_SET) < 0 || lseek(job->fd_dest, cc.eof, SEEK_SET) < 0)
+        return COPY_ERROR;
+
+    *len -= cc.eof - start;
+    return COPY_DONE;
+}
+
+// Copy through a user space buffer and checksum each chunk while it is in
+// the CPU cache, so the data is read only once
+static int copy_checksummed(struct copy_job *job)
+{
+    char *buffer = alloc_aligned(CHECKSUM_BUFSIZE, sysconf(_SC_PAGESIZE));
+    ssize_t bytes_read = 0, bytes_written;
+
+    if (buffer == NULL)
+        return COPY_ERROR;
+
+    job->methods |= 1u << METHOD_READ_WRITE;
+
+    while ((bytes_read = job_read(job, buffer, CHECKSUM_BUFSIZE)) > 0) {
+        job->crc = crc32c(job->crc, buffer, bytes_read);
+        bytes_written = job_write(job, buffer, bytes_read);
+        if (bytes_written != bytes_read) {
+            free(buffer);
+            return COPY_ERROR;
+        }
+    }
+
+    free(buffer);
+    return (bytes_read < 0) ? COPY_ERROR : COPY_DONE;
+}
+
+// CRC32C of what is on disk for fd: write it back and drop it from the page
+// cache first, otherwise we would only check the cached copy
+static int checksum_on_disk(int fd, uint32_t *crc)
+{
+    char *buffer = alloc_aligned(CHECKSUM_BUFSIZE, sysconf(_SC_PAGESIZE));
+    off_t offset = 0;
+    ssize_t n;
+
+    if (buffer == NULL)
+        return -1;
+
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    *crc = 0;
+    while ((n = pread(fd, buffer, CHECKSUM_BUFSIZE, offset)) > 0) {
+        *crc = crc32c(*crc, buffer, n);
+        offset += n;
+    }
+
+    free(buffer);
+    return (n < 0) ? -1 : 0;
+}
+
+// Write back and drop [offset, offset + len) from the page cache on both sides
+static void stream_release(struct copy_job *job, off_t offset, off_t len)
+{
+    sync_file_range(job->fd_dest, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE |
+                    SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(job->fd_dest, offset, len, POSIX_FADV_DONTNEED);
+    posix_fadvise(job->fd_src, offset, len, POSIX_FADV_DONTNEED);
+}
+
+/*
+ * Stream strategy for copies that should not push everything else out of the
+ * page cache. The source is read sequentially with the next STREAM_WINDOW
+ * already in readahead. Each window that was copied has its writeback started
+ * right away. The window before it is waited on, and then both sides of it are
+ * dropped from the cache, so only about two windows stay resident at a time.
+ */
+static int copy_stream(struct copy_job *job, off_t *len)
+{
+    off_t offset, prev = -1, prev_len = 0;
+
+    offset = lseek(job->fd_src, 0, SEEK_CUR);
+    if (offset < 0 || lseek(job->fd_dest, 0, SEEK_CUR) != offset)
+        return COPY_FALLBACK;
+
+    job->methods |= 1u << METHOD_STREAM;
+    posix_fadvise(job->fd_src, offset, 0, POSIX_FADV_SEQUENTIAL);
+    readahead(job->fd_src, offset, STREAM_WINDOW);
+
+    while (*len > 0) {
+        off_t want = (*len < STREAM_WINDOW) ? *len : STREAM_WINDOW;
+        off_t left = want;
+
+        readahead(job->fd_src, offset + want, STREAM_WINDOW);
+
+        if (copy_auto(job, &left) != COPY_DONE)
+            return COPY_ERROR;
+
+        *len -= want - left;
+        sync_file_range(job->fd_dest, offset, want - left, SYNC_FILE_RANGE_WRITE);
+
+        if (prev >= 0)
+            stream_release(job, prev, prev_len);
+        prev = offset;
+        prev_len = want - left;
+        offset += want - left;
+
+        if (left > 0)           // EOF
+            break;
+    }
+
+    if (prev >= 0)
+        stream_release(job, prev, prev_len);
+
+    return COPY_DONE;
+}
+
+/*
+ * Pipeline strategy: a reader thread fills a ring of PIPELINE_SLOTS buffers
+ * while the calling thread writes them out, so reading the source and
+ * writing the destination overlap instead of taking turns. With the two on
+ * different devices the copy runs at the speed of the slower one.
+ *
+ * The ring is single producer, single consumer: only the reader moves head
+ * and only the writer moves tail, so the indices need no lock. A side that
+ * finds the ring full or empty polls the other index for a while, then
+ * sleeps on it with a futex; the other side only makes the wake-up call
+ * when it sees that flag set.
+ */
+
+struct pipeline {
+    struct copy_job *job;
+    char *buffers[PIPELINE_SLOTS];
+    ssize_t lengths[PIPELINE_SLOTS];    // bytes in each slot, 0 at EOF, -1 for a read error
+    uint32_t head;                      // slots filled, moved by the reader
+    uint32_t tail;                      // slots written out, moved by the writer
+    int reader_sleeps;
+    int writer_sleeps;
+    int stop;                           // the writer gave up
+    int err;                            // errno of a failed read
+    off_t len;                          // what the reader should read
+};
+
+// Wait for *index to move on from seen
+static void ring_wait(uint32_t *index, uint32_t seen, int *sleeps)
+{
+    for (int i = 0; i < PIPELINE_SPIN; i++) {
+        if (__atomic_load_n(index, __ATOMIC_ACQUIRE) != seen)
+            return;
+    }
+
+    // The other side checks the flag after moving the index, and the futex
+    // only sleeps if the index is still seen, so no wake-up can be missed
+    __atomic_store_n(sleeps, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(index, __ATOMIC_SEQ_CST) == seen)
+        syscall(SYS_futex, index, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    __atomic_store_n(sleeps, 0, __ATOMIC_RELAXED);
+}
+
+static void ring_advance(uint32_t *index, int *sleeps)
+{
+    __atomic_add_fetch(index, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(sleeps, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, index, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void *pipeline_reader(void *arg)
+{
+    struct pipeline *pl = arg;
+    off_t left = pl->len;
+
+    for (;;) {
+        uint32_t head = pl->head, tail;
+        ssize_t n = 0;
+
+        while (head - (tail = __atomic_load_n(&pl->tail, __ATOMIC_ACQUIRE)) == PIPELINE_SLOTS &&
+               !__atomic_load_n(&pl->stop, __ATOMIC_ACQUIRE))
+            ring_wait(&pl->tail, tail, &pl->reader_sleeps);
+        if (__atomic_load_n(&pl->stop, __ATOMIC_ACQUIRE))
+            break;
+
+        // An empty slot tells the writer we are done
+        if (left > 0) {
+            n = job_read(pl->job, pl->buffers[head % PIPELINE_SLOTS], chunk(left, PIPELINE_BUFSIZE));
+            if (n < 0)
+                pl->err = errno;
+        }
+        pl->lengths[head % PIPELINE_SLOTS] = n;
+        ring_advance(&pl->head, &pl->writer_sleeps);
+
+        if (n <= 0)
+            break;
+        left -= n;
+    }
+    return NULL;
+}
+
+static int copy_pipeline(struct copy_job *job, off_t *len)
+{
+    struct pipeline pl = { .job = job, .len = *len };
+    pthread_t reader;
+    int ret = COPY_DONE;
+
+    for (int i = 0; i < PIPELINE_SLOTS; i++) {
+        pl.buffers[i] = alloc_aligned(PIPELINE_BUFSIZE, sysconf(_SC_PAGESIZE));
+        if (pl.buffers[i] == NULL)
+            ret = COPY_FALLBACK;
+    }
+    if (ret == COPY_DONE && pthread_create(&reader, NULL, pipeline_reader, &pl) != 0)
+        ret = COPY_FALLBACK;
+    if (ret != COPY_DONE) {
+        for (int i = 0; i < PIPELINE_SLOTS; i++)
+            free(pl.buffers[i]);
+        return ret;
+    }
+
+    job->methods |= 1u << METHOD_PIPELINE;
+
+    for (;;) {
+        uint32_t tail = pl.tail, head;
+        const char *data = pl.buffers[tail % PIPELINE_SLOTS];
+        ssize_t n, done = 0;
+
+        while ((head = __atomic_load_n(&pl.head, __ATOMIC_ACQUIRE)) == tail)
+            ring_wait(&pl.head, head, &pl.writer_sleeps);
+
+        n = pl.lengths[tail % PIPELINE_SLOTS];
+        if (n < 0) {
+            errno = pl.err;
+            ret = COPY_ERROR;
+        }
+        if (n <= 0)
+            break;
+
+        while (done < n) {
+            ssize_t written = job_write(job, data + done, n - done);
+            if (written <= 0)
+                break;
+            done += written;
+        }
+        if (done < n) {
+            // Free a slot, so a reader waiting for one wakes up and stops
+            __atomic_store_n(&pl.stop, 1, __ATOMIC_RELEASE);
+            ring_advance(&pl.tail, &pl.reader_sleeps);
+            ret = COPY_ERROR;
+            break;
+        }
+
+        *len -= n;
+        ring_advance(&pl.tail, &pl.reader_sleeps);
+    }
+
+    pthread_join(reader, NULL);
+    for (int i = 0; i < PIPELINE_SLOTS; i++)
+        free(pl.buffers[i]);
+    return ret;
+}
+
+// Move what splice() put in the pipe on to the destination the slow way, for
+// a destination that turns out not to support splice()
+static int drain_pipe(struct copy_job *job, int pipe_rd, size_t pending)
+{
+    char buffer[BUFSIZE];
+
+    while (pending > 0) {
+        ssize_t n = read(pipe_rd, buffer, chunk(pending, sizeof(buffer)));
+        if (n <= 0 || job_write(job, buffer, n) != n)
+            return -1;
+        pending -= n;
+    }
+    return 0;
+}
+
+/*
+ * Pipes, FIFOs and character devices as the source: splice() moves the data
+ * without it ever being copied to user space. splice() needs a pipe on one
+ * side, so when neither end is one the data goes through a pipe of our own.
+ * Ends that can't splice fall back to the buffered copy.
+ */
+static int copy_splice(struct copy_job *job, off_t *len)
+{
+    struct stat st_src, st_dest;
+    int pipefd[2] = {-1, -1};
+    int ret = COPY_DONE;
+    off_t total = 0;
+
+    if (fstat(job->fd_src, &st_src) < 0 || fstat(job->fd_dest, &st_dest) < 0)
+        return COPY_FALLBACK;
+
+    if (!S_ISFIFO(st_src.st_mode) && !S_ISFIFO(st_dest.st_mode)) {
+        if (pipe2(pipefd, O_CLOEXEC) < 0)
+            return COPY_FALLBACK;
+        fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_CHUNK);   // a bigger pipe, when allowed
+    }
+
+    while (*len > 0) {
+        size_t want = chunk(*len, io_chunk(job->opts, SPLICE_CHUNK));
+        long long start;
+        ssize_t n, pending;
+
+        throttle(job->opts, want);
+        start = stats_begin(job->opts);
+        if (pipefd[0] < 0) {
+            n = splice(job->fd_src, NULL, job->fd_dest, NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            stats_call(job->opts, CALL_TRANSFER, start, n, want);
+        } else {
+            n = splice(job->fd_src, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            stats_call(job->opts, CALL_READ, start, n, want);
+        }
+        unthrottle(job->opts, want, n);
+        if (n < 0) {
+            ret = (total == 0 && unsupported(errno)) ? COPY_FALLBACK : COPY_ERROR;
+            break;
+        }
+        if (n == 0)
+            break;
+
+        // Empty our pipe into the destination
+        for (pending = (pipefd[0] < 0) ? 0 : n; pending > 0; ) {
+            ssize_t m;
+
+            start = stats_begin(job->opts);
+            m = splice(pipefd[0], NULL, job->fd_dest, NULL, pending, SPLICE_F_MOVE | SPLICE_F_MORE);
+            stats_call(job->opts, CALL_WRITE, start, m, pending);
+            if (m <= 0) {
+                if (m < 0 && unsupported(errno) && drain_pipe(job, pipefd[0], pending) == 0) {
+                    *len -= n;
+                    total += n;
+                    ret = COPY_FALLBACK;
+                } else {
+                    ret = COPY_ERROR;
+                }
+                break;
+            }
+            pending -= m;
+        }
+        if (pending > 0)
+            break;
+
+        *len -= n;
+        total += n;
+    }
+
+    if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    if (total > 0)
+        job->methods |= 1u << METHOD_SPLICE;
+    return ret;
+}
+
+// Copy with the selected strategy, falling back to copy_file_range(), then
+// sendfile(), then the plain read()/write() loop
+static int copy_data(struct copy_job *job, off_t len)
+{
+    int ret;
+
+    switch (job->strategy) {
+    case STRATEGY_READ_WRITE:
+        return copy_read_write(job, &len);
+    case STRATEGY_MMAP:
+        ret = copy_mmap(job, &len);
+        break;
+    case STRATEGY_IO_URING:
+        ret = copy_uring(job, &len);
+        break;
+    case STRATEGY_THREADS:
+        ret = copy_threads(job, &len);
+        break;
+    case STRATEGY_STREAM:
+        ret = copy_stream(job, &len);
+        break;
+    case STRATEGY_PIPELINE:
+        ret = copy_pipeline(job, &len);
+        break;
+    case STRATEGY_SENDFILE:
+        ret = copy_sendfile(job, &len);
+        break;
+    default:
+        return copy_auto(job, &len);
+    }
+
+    if (ret == COPY_FALLBACK)
+        ret = copy_read_write(job, &len);
+
+    return ret;
+}
+
+static int clone_failed(struct copy_job *job)
+{
+    if (job->opts->reflink == REFLINK_ALWAYS)
+        return COPY_ERROR;
+
+    job->no_clone = 1;
+    return COPY_FALLBACK;
+}
+
+// Required O_DIRECT alignment of file offsets, lengths and buffers for fd
+static size_t direct_alignment(int fd)
+{
+    struct stat st;
+
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+        (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align != 0) {
+        return (stx.stx_dio_offset_align > stx.stx_dio_mem_align) ?
+               stx.stx_dio_offset_align : stx.stx_dio_mem_align;
+    }
+#endif
+
+    if (fstat(fd, &st) < 0)
+        return 4096;
+
+    if (S_ISBLK(st.st_mode)) {
+        int sector_size;
+        if (ioctl(fd, BLKSSZGET, &sector_size) == 0 && sector_size > 0)
+            return (size_t) sector_size;
+    }
+
+    return (st.st_blksize > 0) ? (size_t) st.st_blksize : 4096;
+}
+
+// Copy [offset, offset + len) with O_DIRECT on both files, so the data does not
+// go through (and evict) the page cache. Reads and writes are done in aligned
+// chunks; an unaligned tail at EOF is written padded to the alignment and cut
+// off again with ftruncate().
+static int copy_direct(struct copy_job *job, off_t offset, off_t len)
+{
+    struct stat st_src, st_dest;
+    int flags_src, flags_dest;
+    size_t align, bufsize;
+    off_t end = -1;
+    char *buffer;
+    int ret = COPY_DONE;
+
+    // The copy needs pread() and pwrite(). A pipe even takes O_DIRECT (as
+    // packet mode), and stdout may share its file description with others.
+    if (fstat(job->fd_src, &st_src) < 0 || fstat(job->fd_dest, &st_dest) < 0)
+        return COPY_ERROR;
+    if (!(S_ISREG(st_src.st_mode) || S_ISBLK(st_src.st_mode)) ||
+        !(S_ISREG(st_dest.st_mode) || S_ISBLK(st_dest.st_mode)))
+        return COPY_FALLBACK;
+
+    flags_src = fcntl(job->fd_src, F_GETFL);
+    flags_dest = fcntl(job->fd_dest, F_GETFL);
+    if (flags_src < 0 || flags_dest < 0)
+        return COPY_ERROR;
+
+    // tmpfs and some network file systems refuse O_DIRECT
+    if (fcntl(job->fd_src, F_SETFL, flags_src | O_DIRECT) < 0)
+        return COPY_FALLBACK;
+    if (fcntl(job->fd_dest, F_SETFL, flags_dest | O_DIRECT) < 0) {
+        fcntl(job->fd_src, F_SETFL, flags_src);
+        return COPY_FALLBACK;
+    }
+
+    align = direct_alignment(job->fd_src);
+    if (direct_alignment(job->fd_dest) > align)
+        align = direct_alignment(job->fd_dest);
+    bufsize = ROUND_UP(DIRECT_BUFSIZE, align);
+
+    buffer = alloc_aligned(bufsize, align);
+    if (buffer == NULL || offset % align != 0) {
+        ret = COPY_FALLBACK;
+        goto out;
+    }
+
+    job->methods |= 1u << METHOD_DIRECT;
+
+    while (len > 0) {
+        size_t want = ROUND_UP(chunk(len, bufsize), align);
+        ssize_t bytes_read = job_pread(job, buffer, want, offset);
+        size_t padded;
+
+        if (bytes_read < 0) {
+            ret = COPY_ERROR;
+            break;
+        }
+        if (bytes_read == 0)
+            break;
+
+        padded = ROUND_UP((size_t) bytes_read, align);
+        if (padded != (size_t) bytes_read) {
+            memset(buffer + bytes_read, 0, padded - bytes_read);
+            end = offset + bytes_read;
+        }
+
+        if (job_pwrite(job, buffer, padded, offset) != (ssize_t) padded) {
+            ret = COPY_ERROR;
+            break;
+        }
+
+        offset += bytes_read;
+        len -= bytes_read;
+        if ((size_t) bytes_read < want)     // EOF
+            break;
+    }
+
+    if (ret == COPY_DONE && end >= 0 && ftruncate(job->fd_dest, end) < 0)
+        ret = COPY_ERROR;
+
+out:
+    free(buffer);
+    fcntl(job->fd_src, F_SETFL, flags_src);
+    fcntl(job->fd_dest, F_SETFL, flags_dest);
+    return ret;
+}
+
+// Share the blocks of the whole source with the destination
+static int clone_file(struct copy_job *job)
+{
+    long long start;
+    int ret;
+
+    if (job->opts->reflink == REFLINK_NEVER || job->no_clone)
+        return COPY_FALLBACK;
+
+    start = stats_begin(job->opts);
+    ret = ioctl(job->fd_dest, FICLONE, job->fd_src);
+    stats_call(job->opts, CALL_TRANSFER, start, 0, 0);
+    if (ret == 0) {
+        job->methods |= 1u << METHOD_CLONE;
+        return COPY_DONE;
+    }
+
+    return clone_failed(job);
+}
+
+// Share the blocks of [offset, offset + len) of the source with the same
+// range of the destination. Offsets must be block aligned, and so must the
+// length unless the range ends at EOF of the source.
+static int clone_range(struct copy_job *job, off_t offset, off_t len)
+{
+    struct file_clone_range range = {
+        .src_fd = job->fd_src,
+        .src_offset = (__u64) offset,
+        .src_length = (__u64) len,
+        .dest_offset = (__u64) offset,
+    };
+    long long start;
+    int ret;
+
+    if (job->opts->reflink == REFLINK_NEVER || job->no_clone)
+        return COPY_FALLBACK;
+
+    start = stats_begin(job->opts);
+    ret = ioctl(job->fd_dest, FICLONERANGE, &range);
+    stats_call(job->opts, CALL_TRANSFER, start, 0, 0);
+    if (ret == 0) {
+        job->methods |= 1u << METHOD_CLONE;
+        return COPY_DONE;
+    }
+
+    return clone_failed(job);
+}
+
+// Clone or copy only the data extents of the source and seek over its holes,
+// which the freshly truncated destination then keeps as holes.
+static int copy_sparse(struct copy_job *job, off_t size)
+{
+    off_t data, hole = 0;
+    int ret;
+
+    while (hole < size) {
+        data = lseek(job->fd_src, hole, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO)         // only a hole is left
+                break;
+            if (hole == 0 && unsupported(errno))
+                return COPY_FALLBACK;
+            return COPY_ERROR;
+        }
+
+        hole = lseek(job->fd_src, data, SEEK_HOLE);
+        if (hole < 0)
+            return COPY_ERROR;
+        if (hole > size)
+            hole = size;
+
+        ret = clone_range(job, data, hole - data);
+        if (ret == COPY_ERROR)
+            return COPY_ERROR;
+        if (ret == COPY_DONE)
+            continue;
+
+        if (job->strategy == STRATEGY_DIRECT) {
+            ret = copy_direct(job, data, hole - data);
+            if (ret == COPY_ERROR)
+                return COPY_ERROR;
+            if (ret == COPY_DONE)
+                continue;
+        }
+
+        if (lseek(job->fd_src, data, SEEK_SET) < 0 ||
+            lseek(job->fd_dest, data, SEEK_SET) < 0)
+            return COPY_ERROR;
+
+        if (copy_data(job, hole - data) != COPY_DONE)
+            return COPY_ERROR;
+    }
+
+    // A trailing hole is not written, so set the size explicitly
+    if (ftruncate(job->fd_dest, size) < 0)
+        return COPY_ERROR;
+
+    return COPY_DONE;
+}
+
+static int write_at(struct copy_job *job, const char *data, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = job_pwrite(job, data, len, offset);
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * Incremental copy into an existing destination: map both files a window at
+ * a time, compare them DELTA_BLOCK by DELTA_BLOCK and pwrite() only the runs
+ * of blocks that differ. A longer source is appended, a shorter one cuts the
+ * destination. Refreshing a file in which little changed costs little more
+ * than reading both.
+ */
+static int copy_delta(struct copy_job *job, off_t size)
+{
+    struct stat st;
+    off_t common, offset = 0, len;
+
+    if (fstat(job->fd_dest, &st) < 0 || !S_ISREG(st.st_mode))
+        return COPY_FALLBACK;
+
+    job->methods |= 1u << METHOD_DELTA;
+    common = (st.st_size < size) ? st.st_size : size;
+
+    while (offset < common) {
+        size_t count = chunk(common - offset, MMAP_WINDOW);
+        char *src = mmap(NULL, count, PROT_READ, MAP_SHARED, job->fd_src, offset);
+        char *dest = mmap(NULL, count, PROT_READ, MAP_SHARED, job->fd_dest, offset);
+        size_t pos = 0;
+
+        if (src == MAP_FAILED || dest == MAP_FAILED) {
+            if (src != MAP_FAILED)
+                munmap(src, count);
+            if (dest != MAP_FAILED)
+                munmap(dest, count);
+            return COPY_ERROR;
+        }
+        madvise(src, count, MADV_SEQUENTIAL);
+        madvise(dest, count, MADV_SEQUENTIAL);
+
+        while (pos < count) {
+            size_t start = pos;
+
+            // Find the next run of differing blocks
+            while (pos < count && memcmp(src + pos, dest + pos, chunk(count - pos, DELTA_BLOCK)) != 0)
+                pos += chunk(count - pos, DELTA_BLOCK);
+
+            if (pos > start) {
+                if (write_at(job, src + start, pos - start, offset + start) < 0) {
+                    munmap(src, count);
+                    munmap(dest, count);
+                    return COPY_ERROR;
+                }
+                job->rewritten += pos - start;
+            } else {
+                pos += chunk(count - pos, DELTA_BLOCK);
+            }
+        }
+
+        munmap(src, count);
+        munmap(dest, count);
+        offset += count;
+    }
+
+    if (size > common) {
+        if (lseek(job->fd_src, common, SEEK_SET) < 0 || lseek(job->fd_dest, common, SEEK_SET) < 0)
+            return COPY_ERROR;
+        len = size - common;
+        if (copy_auto(job, &len) != COPY_DONE)
+            return COPY_ERROR;
+        job->rewritten += size - common - len;
+    }
+
+    return (ftruncate(job->fd_dest, size) < 0) ? COPY_ERROR : COPY_DONE;
+}
+
+/*
+ * Resumable copy (--resume). Every RESUME_INTERVAL bytes the destination is
+ * flushed with fdatasync() and then a record of how far we got, with the
+ * CRC32C of that prefix, is written to a journal next to it. A later run
+ * checks the record against the source and the destination prefix and
+ * continues from the checkpoint; a record that does not check out means
+ * starting over. The journal is removed once the copy is complete.
+ */
+
+struct journal {
+    uint32_t magic;
+    uint32_t crc;               // CRC32C of the first offset bytes
+    uint64_t size;              // the source this is a copy of
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t offset;            // bytes safely on disk in the destination
+    uint32_t check;             // CRC32C of the fields above
+    uint32_t pad;
+};
+
+static uint32_t journal_check(const struct journal *rec)
+{
+    return crc32c(0, rec, offsetof(struct journal, check));
+}
+
+static int journal_write(struct copy_job *job, const struct stat *st, off_t offset, uint32_t crc)
+{
+    struct journal rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = JOURNAL_MAGIC;
+    rec.crc = crc;
+    rec.size = st->st_size;
+    rec.mtime_sec = st->st_mtim.tv_sec;
+    rec.mtime_nsec = st->st_mtim.tv_nsec;
+    rec.offset = offset;
+    rec.check = journal_check(&rec);
+
+    // The data the record vouches for must reach the disk before the record
+    if (fdatasync(job->fd_dest) < 0)
+        return -1;
+    if (pwrite(job->fd_journal, &rec, sizeof(rec), 0) != sizeof(rec))
+        return -1;
+    return fdatasync(job->fd_journal);
+}
+
+// Offset to continue from, with the CRC32C of what is before it in *crc
+static off_t journal_read(struct copy_job *job, const struct stat *st, uint32_t *crc, char *buffer)
+{
+    struct journal rec;
+    struct stat st_dest;
+    off_t offset = 0;
+    uint32_t prefix = 0;
+
+    if (pread(job->fd_journal, &rec, sizeof(rec), 0) != sizeof(rec) ||
+        rec.magic != JOURNAL_MAGIC || rec.check != journal_check(&rec))
+        return 0;
+
+    // The source changed since the checkpoint, or the destination lost data
+    if (rec.size != (uint64_t) st->st_size || rec.mtime_sec != st->st_mtim.tv_sec ||
+        rec.mtime_nsec != st->st_mtim.tv_nsec || rec.offset > (uint64_t) st->st_size ||
+        fstat(job->fd_dest, &st_dest) < 0 || (uint64_t) st_dest.st_size < rec.offset)
+        return 0;
+
+    while (offset < (off_t) rec.offset) {
+        ssize_t n = pread(job->fd_dest, buffer, chunk(rec.offset - offset, CHECKSUM_BUFSIZE), offset);
+        if (n <= 0)
+            return 0;
+        prefix = crc32c(prefix, buffer, n);
+        offset += n;
+    }
+    if (prefix != rec.crc)
+        return 0;
+
+    *crc = prefix;
+    return offset;
+}
+
+static int copy_resumable(struct copy_job *job, const struct stat *st)
+{
+    char *buffer = alloc_aligned(CHECKSUM_BUFSIZE, sysconf(_SC_PAGESIZE));
+    off_t offset, checkpoint;
+    uint32_t crc = 0;
+    ssize_t n = 0;
+
+    if (buffer == NULL)
+        return COPY_ERROR;
+
+    offset = journal_read(job, st, &crc, buffer);
+    if (offset == 0 && ftruncate(job->fd_dest, 0) < 0) {
+        free(buffer);
+        return COPY_ERROR;
+    }
+    job->resumed = offset;
+    job->methods |= 1u << METHOD_READ_WRITE;
+    checkpoint = offset + RESUME_INTERVAL;
+
+    while ((n = job_pread(job, buffer, CHECKSUM_BUFSIZE, offset)) > 0) {
+        if (write_at(job, buffer, n, offset) < 0)
+            break;
+        crc = crc32c(crc, buffer, n);
+        offset += n;
+
+        if (offset >= checkpoint) {
+            if (journal_write(job, st, offset, crc) < 0)
+                break;
+            checkpoint = offset + RESUME_INTERVAL;
+        }
+    }
+
+    free(buffer);
+    if (n != 0)
+        return COPY_ERROR;
+
+    job->crc = crc;
+    return (ftruncate(job->fd_dest, offset) < 0) ? COPY_ERROR : COPY_DONE;
+}
+
+/*
+ * Small files are the common case of a recursive or many-file copy, where
+ * the per-file system calls cost more than moving the data. One read() of
+ * a byte more than the size both gets the data and tells that we are at
+ * EOF, and one write() stores it. Only a file that grew since the fstat()
+ * needs another method for the rest.
+ */
+static int copy_tiny(struct copy_job *job, size_t size)
+{
+    char buffer[TINY_FILE + 1];
+    ssize_t n;
+
+    job->methods |= 1u << METHOD_READ_WRITE;
+
+    n = job_read(job, buffer, size + 1);
+    if (n < 0)
+        return COPY_ERROR;
+    if (n > 0 && job_write(job, buffer, n) != n)
+        return COPY_ERROR;
+
+    return ((size_t) n > size) ? copy_data(job, TO_EOF) : COPY_DONE;
+}
+
+// Whether the options leave the data path up to us
+static int plain_copy(const struct cp_options *opts)
+{
+    return opts->strategy == STRATEGY_AUTO && opts->reflink != REFLINK_ALWAYS &&
+           opts->sparse != SPARSE_ALWAYS && !opts->checksum && !opts->verify &&
+           !opts->expect_set && !opts->incremental && !opts->resume;
+}
+
+/*
+ * Strategy table. Which way of moving the data is fastest depends on the
+ * file systems, on whether the source and destination share a device, and
+ * on the file size, so --strategy=auto (the default) looks the file up in a
+ * table keyed on those. cp --calibrate times the strategies on a pair of
+ * directories and stores the winners in the tuning file; files without a
+ * calibrated row get the built-in defaults below.
+ */
+
+static const struct tuning builtin_tuning[] = {
+    // Writes to memory don't wait for a device, nothing to overlap
+    { TMPFS_MAGIC, -1, SIZE_CLASSES, STRATEGY_AUTO },
+    // Reading one device while writing the other
+    { 0, 0, SIZE_LARGE, STRATEGY_PIPELINE },
+    // copy_file_range(), which also lets NFS and SMB copy on the server
+    { 0, -1, SIZE_CLASSES, STRATEGY_AUTO },
+};
+
+static SizeClass size_class(off_t size)
+{
+    return (size < SMALL_FILE) ? SIZE_SMALL : (size < LARGE_FILE) ? SIZE_MEDIUM : SIZE_LARGE;
+}
+
+static const struct tuning *find_tuning(const struct tuning *rows, int count,
+                                        unsigned long fs_type, int same_device, SizeClass size)
+{
+    for (int i = 0; i < count; i++) {
+        if ((rows[i].fs_type == 0 || rows[i].fs_type == fs_type) &&
+            (rows[i].same_device < 0 || rows[i].same_device == same_device) &&
+            (rows[i].size == SIZE_CLASSES || rows[i].size == size))
+            return &rows[i];
+    }
+    return NULL;
+}
+
+// Set job->strategy for a regular file of st->st_size bytes
+static void pick_strategy(struct copy_job *job, const struct stat *st)
+{
+    const struct tuning_table *table = job->opts->tuning;
+    const struct tuning *row;
+    struct stat st_dest;
+    struct statfs sfs;
+
+    if (fstat(job->fd_dest, &st_dest) < 0 || fstatfs(job->fd_dest, &sfs) < 0)
+        return;
+
+    row = find_tuning(table->rows, table->count, sfs.f_type, st->st_dev == st_dest.st_dev,
+                      size_class(st->st_size));
+    job->picked_by = "calibrated";
+    if (row == NULL) {
+        row = find_tuning(builtin_tuning, sizeof(builtin_tuning) / sizeof(builtin_tuning[0]),
+                          sfs.f_type, st->st_dev == st_dest.st_dev, size_class(st->st_size));
+        job->picked_by = "built-in";
+    }
+    job->strategy = row->strategy;
+}
+
+static int copy_file(struct copy_job *job)
+{
+    const struct cp_options *opts = job->opts;
+    struct stat st, st_dest;
+    int sparse = 0, ret;
+
+    if (fstat(job->fd_src, &st) < 0)
+        return COPY_ERROR;
+
+    // procfs files claim to be empty, so those take the normal path
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= TINY_FILE && plain_copy(opts))
+        return copy_tiny(job, st.st_size);
+
+    if (job->fd_journal >= 0 && S_ISREG(st.st_mode))
+        return copy_resumable(job, &st);
+
+    // The destination was not truncated for --incremental or --resume; when
+    // neither the delta nor the resumable copy can be used, such as for a
+    // pipe, truncate it now and copy normally
+    if (opts->incremental || job->fd_journal >= 0) {
+        if (opts->incremental && S_ISREG(st.st_mode) &&
+            !opts->checksum && !opts->verify && !opts->expect_set) {
+            ret = copy_delta(job, st.st_size);
+            if (ret != COPY_FALLBACK)
+                return ret;
+        }
+        if (fstat(job->fd_dest, &st_dest) == 0 && S_ISREG(st_dest.st_mode) &&
+            ftruncate(job->fd_dest, 0) < 0)
+            return COPY_ERROR;
+    }
+
+    // Checksums need every byte in user space, which only this copy has
+    if (opts->checksum || opts->verify || opts->expect_set)
+        return copy_checksummed(job);
+
+    if (!S_ISREG(st.st_mode)) {
+        off_t len = TO_EOF;
+
+        ret = copy_splice(job, &len);
+        if (ret != COPY_FALLBACK)
+            return ret;
+        return copy_data(job, len);
+    }
+
+    // Holes can only be kept by seeking, which pipes and devices refuse
+    if (fstat(job->fd_dest, &st_dest) < 0)
+        return COPY_ERROR;
+    if (!S_ISREG(st_dest.st_mode))
+        sparse = 0;
+    else if (opts->sparse == SPARSE_ALWAYS)
+        sparse = 1;
+    else if (opts->sparse == SPARSE_AUTO)
+        sparse = (off_t) st.st_blocks * 512 < st.st_size;
+
+    if (sparse) {
+        ret = copy_sparse(job, st.st_size);
+        if (ret != COPY_FALLBACK)
+            return ret;
+    }
+
+    ret = clone_file(job);
+    if (ret != COPY_FALLBACK)
+        return ret;
+
+    if (opts->strategy == STRATEGY_AUTO && opts->tuning != NULL)
+        pick_strategy(job, &st);
+
+    // Reserve all blocks up front so the file system can allocate them in a
+    // few large extents instead of one small allocation per write. The size
+    // is kept, so the destination still grows as the data is written.
+    if (st.st_size >= PREALLOC_MIN)
+        fallocate(job->fd_dest, FALLOC_FL_KEEP_SIZE, 0, st.st_size);
+
+    if (job->strategy == STRATEGY_DIRECT) {
+        ret = copy_direct(job, 0, TO_EOF);
+        if (ret != COPY_FALLBACK)
+            return ret;
+    }
+
+    return copy_data(job, TO_EOF);
+}
+
+// Print one line per copy, with a single write() so workers don't interleave
+static void report(int fd, const char *source, const char *destination, const struct copy_job *job)
+{
+    char line[2 * PATH_MAX + 128];
+    const char *sep = " (";
+    int len;
+
+    len = snprintf(line, sizeof(line), "'%s' -> '%s'", source, destination);
+    for (int i = 0; i < METHOD_COUNT && len < (int) sizeof(line); i++) {
+        if (job->methods & (1u << i)) {
+            len += snprintf(line + len, sizeof(line) - len, "%s%s", sep, method_names[i]);
+            sep = ", ";
+        }
+    }
+    if (len < (int) sizeof(line) && (job->methods & (1u << METHOD_DELTA)))
+        len += snprintf(line + len, sizeof(line) - len, ": %lld bytes rewritten",
+                        (long long) job->rewritten);
+    if (len < (int) sizeof(line) && job->resumed > 0)
+        len += snprintf(line + len, sizeof(line) - len, ": resumed at %lld",
+                        (long long) job->resumed);
+    if (len < (int) sizeof(line))
+        len += snprintf(line + len, sizeof(line) - len, "%s", job->methods ? ")" : "");
+    if (len < (int) sizeof(line) && job->picked_by != NULL)
+        len += snprintf(line + len, sizeof(line) - len, " [strategy %s, %s]",
+                        strategy_names[job->strategy], job->picked_by);
+    if (len < (int) sizeof(line))
+        len += snprintf(line + len, sizeof(line) - len, "\n");
+    if (len > (int) sizeof(line))
+        len = sizeof(line);
+
+    write(fd, line, len);
+}
+
+// Whether UPDATE_SAMPLE_SIZE blocks spread over both files, first and last
+// included, hold the same bytes. size is the size of both.
+static int same_samples(int src_dirfd, const char *src_name, int dest_dirfd,
+                        const char *dest_name, off_t size)
+{
+    char src_block[UPDATE_SAMPLE_SIZE], dest_block[UPDATE_SAMPLE_SIZE];
+    off_t last = (size > UPDATE_SAMPLE_SIZE) ? size - UPDATE_SAMPLE_SIZE : 0;
+    int samples = (size > UPDATE_SAMPLE_SIZE) ? UPDATE_SAMPLES : 1;
+    int fd_src, fd_dest, same;
+
+    fd_src = openat(src_dirfd, src_name, O_RDONLY);
+    fd_dest = openat(dest_dirfd, dest_name, O_RDONLY);
+    same = fd_src >= 0 && fd_dest >= 0;
+
+    for (int i = 0; i < samples && same; i++) {
+        off_t offset = (i == samples - 1) ? last : last / (samples - 1) * i;
+        ssize_t n = pread(fd_src, src_block, sizeof(src_block), offset);
+
+        same = n >= 0 && pread(fd_dest, dest_block, sizeof(dest_block), offset) == n &&
+               memcmp(src_block, dest_block, n) == 0;
+    }
+
+    if (fd_src >= 0)
+        close(fd_src);
+    if (fd_dest >= 0)
+        close(fd_dest);
+    return same;
+}
+
+// For --update: 1 when the destination already matches the source, 0 when
+// it must be copied, -1 when the source cannot be looked at. Only the
+// sampled check reads any data. stx gets the source timestamps.
+static int up_to_date(int src_dirfd, const char *src_name, int dest_dirfd,
+                      const char *dest_name, const struct cp_options *opts, struct statx *stx)
+{
+    unsigned int mask = STATX_TYPE | STATX_SIZE | STATX_MTIME;
+    struct statx dest;
+
+    if (statx(src_dirfd, src_name, 0, mask | STATX_ATIME, stx) < 0)
+        return -1;
+    if (statx(dest_dirfd, dest_name, 0, mask, &dest) < 0)
+        return 0;
+
+    if (!S_ISREG(stx->stx_mode) || !S_ISREG(dest.stx_mode) ||
+        stx->stx_size != dest.stx_size ||
+        stx->stx_mtime.tv_sec != dest.stx_mtime.tv_sec ||
+        stx->stx_mtime.tv_nsec != dest.stx_mtime.tv_nsec)
+        return 0;
+
+    if (opts->update == UPDATE_SAMPLE)
+        return same_samples(src_dirfd, src_name, dest_dirfd, dest_name, stx->stx_size);
+    return 1;
+}
+
+// The directory part of path, "." when there is none
+static void parent_dir(const char *path, char *dir, size_t size)
+{
+    const char *slash = strrchr(path, '/');
+
+    if (slash == NULL)
+        snprintf(dir, size, ".");
+    else if (slash == path)
+        snprintf(dir, size, "/");
+    else
+        snprintf(dir, size, "%.*s", (int) (slash - path), path);
+}
+
+// A hidden name next to path, unique within the process and, through the
+// pid, across processes
+static void temp_name(const char *path, char *name, size_t size)
+{
+    static unsigned long counter;
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? slash - path + 1 : 0;
+
+    snprintf(name, size, "%.*s.%.200s.cp-%d-%lu", dir_len, path, slash ? slash + 1 : path,
+             (int) getpid(), __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED));
+}
+
+// Give a file (as for linkat()) the name dest_name in one step, so that
+// whatever has that name now is replaced without a moment where it is
+// missing: link it under a temporary name, then rename that over.
+static int link_replace(int old_dirfd, const char *old_name, int flags,
+                        int dest_dirfd, const char *dest_name)
+{
+    char name[PATH_MAX + 64];
+    int err;
+
+    if (linkat(old_dirfd, old_name, dest_dirfd, dest_name, flags) == 0)
+        return 0;
+    if (errno != EEXIST)
+        return -1;
+
+    temp_name(dest_name, name, sizeof(name));
+    if (linkat(old_dirfd, old_name, dest_dirfd, name, flags) < 0)
+        return -1;
+    if (renameat(dest_dirfd, name, dest_dirfd, dest_name) < 0) {
+        err = errno;
+        unlinkat(dest_dirfd, name, 0);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// For --atomic: an unnamed file in the directory of dest_name. File systems
+// without O_TMPFILE get a hidden file instead, whose name goes in temp.
+static int open_atomic(int dest_dirfd, const char *dest_name, mode_t mode,
+                       char *temp, size_t size)
+{
+    char dir[PATH_MAX];
+    int fd;
+
+    temp[0] = '\0';
+    parent_dir(dest_name, dir, sizeof(dir));
+    fd = openat(dest_dirfd, dir, O_TMPFILE | O_WRONLY, mode);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL))
+        return fd;
+
+    for (int tries = 0; tries < 100; tries++) {
+        temp_name(dest_name, temp, size);
+        fd = openat(dest_dirfd, temp, O_WRONLY | O_CREAT | O_EXCL, mode);
+        if (fd >= 0 || errno != EEXIST)
+            break;
+    }
+    if (fd < 0)
+        temp[0] = '\0';
+    return fd;
+}
+
+// Put the complete file behind dest_name. Readers see the old file or the
+// new one, never a part of it.
+static int publish_atomic(int fd, int dest_dirfd, const char *dest_name, const char *temp)
+{
+    char proc_path[64];
+
+    if (temp[0] != '\0')
+        return renameat(dest_dirfd, temp, dest_dirfd, dest_name);
+
+    // linkat() with AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, /proc does not
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    return link_replace(AT_FDCWD, proc_path, AT_SYMLINK_FOLLOW, dest_dirfd, dest_name);
+}
+
+// Make the new name of a published file durable
+static int sync_parent(int dest_dirfd, const char *dest_name)
+{
+    char dir[PATH_MAX];
+    int fd, ret;
+
+    parent_dir(dest_name, dir, sizeof(dir));
+    fd = openat(dest_dirfd, dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return -1;
+    ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+// Copy the regular file src_name (relative to src_dirfd) to dest_name
+// (relative to dest_dirfd). The paths are only used for messages.
+static int copy_one(int src_dirfd, const char *src_name, int dest_dirfd, const char *dest_name,
+                    mode_t mode, const struct cp_options *opts,
+                    const char *src_path, const char *dest_path)
+{
+    char journal_name[PATH_MAX + sizeof(JOURNAL_SUFFIX)], temp[PATH_MAX + 64];
+    int src_stdin = (src_dirfd == AT_FDCWD && strcmp(src_name, "-") == 0);
+    int dest_stdout = (dest_dirfd == AT_FDCWD && strcmp(dest_name, "-") == 0);
+    int out = dest_stdout ? STDERR_FILENO : STDOUT_FILENO;  // keep messages out of the data
+    int update = opts->update != UPDATE_NONE && !src_stdin && !dest_stdout;
+    int atomic = opts->atomic && !dest_stdout;
+    int fd_src, fd_dest, fd_journal = -1, copy_errno = 0, ret;
+    struct statx stx;
+
+    if (update) {
+        ret = up_to_date(src_dirfd, src_name, dest_dirfd, dest_name, opts, &stx);
+        if (ret < 0)
+            return 1;
+        if (ret > 0) {
+            if (opts->verbose) {
+                char line[2 * PATH_MAX + 32];
+                int len = snprintf(line, sizeof(line), "'%s' -> '%s' (up to date)\n",
+                                   src_path, dest_path);
+                write(out, line, (len < (int) sizeof(line)) ? len : (int) sizeof(line));
+            }
+            if (opts->stats != NULL)
+                __atomic_add_fetch(&opts->stats->skipped, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+
+    fd_src = src_stdin ? dup(STDIN_FILENO) : openat(src_dirfd, src_name, O_RDONLY);
+    if (fd_src < 0) {
+        return 1;
+    }
+
+    // An incremental or resumed copy needs to read what is already there
+    if (dest_stdout)
+        fd_dest = dup(STDOUT_FILENO);
+    else if (atomic)
+        fd_dest = open_atomic(dest_dirfd, dest_name, mode, temp, sizeof(temp));
+    else
+        fd_dest = openat(dest_dirfd, dest_name,
+                         (opts->incremental || opts->resume) ? O_RDWR | O_CREAT
+                                                             : O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd_dest < 0) {
+        close(fd_src);
+        return 1;
+    }
+
+    if (opts->resume && !dest_stdout) {
+        snprintf(journal_name, sizeof(journal_name), "%s%s", dest_name, JOURNAL_SUFFIX);
+        fd_journal = openat(dest_dirfd, journal_name, O_RDWR | O_CREAT, 0600);
+        if (fd_journal < 0) {
+            fprintf(stderr, "cp: cannot open journal for '%s': %s\n", dest_path, strerror(errno));
+            close(fd_src);
+            close(fd_dest);
+            return 1;
+        }
+    }
+
+    struct copy_job job = {
+        .fd_src = fd_src,
+        .fd_dest = fd_dest,
+        .opts = opts,
+        .fd_journal = fd_journal,
+        .strategy = opts->strategy,
+    };
+
+    ret = copy_file(&job);
+    if (ret != COPY_DONE)
+        copy_errno = errno;
+
+    // FIFOs and the like have nothing to sync (EINVAL)
+    if (ret == COPY_DONE && opts->sync && fdatasync(fd_dest) < 0 && errno != EINVAL) {
+        fprintf(stderr, "cp: cannot sync '%s': %s\n", dest_path, strerror(errno));
+        ret = COPY_ERROR;
+    }
+
+    // Give the copy the source times, so the next --update can skip it
+    if (ret == COPY_DONE && update) {
+        struct timespec times[2] = {
+            { .tv_sec = stx.stx_atime.tv_sec, .tv_nsec = stx.stx_atime.tv_nsec },
+            { .tv_sec = stx.stx_mtime.tv_sec, .tv_nsec = stx.stx_mtime.tv_nsec },
+        };
+
+        if (futimens(fd_dest, times) < 0) {
+            fprintf(stderr, "cp: cannot set times of '%s': %s\n", dest_path, strerror(errno));
+            ret = COPY_ERROR;
+        }
+    }
+
+    // A failed copy keeps its journal for the next run
+    if (fd_journal >= 0) {
+        close(fd_journal);
+        if (ret == COPY_DONE)
+            unlinkat(dest_dirfd, journal_name, 0);
+    }
+
+    if (ret != COPY_DONE && opts->reflink == REFLINK_ALWAYS && job.methods == 0)
+        fprintf(stderr, "cp: failed to clone '%s' from '%s'\n", dest_path, src_path);
+    else if (ret != COPY_DONE)
+        fprintf(stderr, "cp: error copying '%s' to '%s': %s\n", src_path, dest_path,
+                strerror(copy_errno));
+
+    if (ret == COPY_DONE && opts->expect_set && job.crc != opts->expect) {
+        fprintf(stderr, "cp: checksum mismatch for '%s': expected %08x, got %08x\n",
+                src_path, opts->expect, job.crc);
+        ret = COPY_ERROR;
+    }
+
+    // An atomic copy is checked before it is published, through its fd
+    if (ret == COPY_DONE && opts->verify) {
+        char proc_path[64];
+        int fd_check = -1;
+        uint32_t crc;
+
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd_dest);
+        if (atomic)
+            fd_check = open(proc_path, O_RDONLY);
+        else if (!dest_stdout)
+            fd_check = openat(dest_dirfd, dest_name, O_RDONLY);
+
+        if (dest_stdout)
+            errno = ESPIPE;
+
+        if (fd_check < 0 || checksum_on_disk(fd_check, &crc) < 0) {
+            fprintf(stderr, "cp: cannot read back '%s': %s\n", dest_path, strerror(errno));
+            ret = COPY_ERROR;
+        } else if (crc != job.crc) {
+            fprintf(stderr, "cp: verification of '%s' failed: expected %08x, got %08x\n",
+                    dest_path, job.crc, crc);
+            ret = COPY_ERROR;
+        }
+        if (fd_check >= 0)
+            close(fd_check);
+    }
+
+    if (atomic) {
+        if (ret == COPY_DONE && (publish_atomic(fd_dest, dest_dirfd, dest_name, temp) < 0 ||
+                                 (opts->sync && sync_parent(dest_dirfd, dest_name) < 0))) {
+            fprintf(stderr, "cp: cannot publish '%s': %s\n", dest_path, strerror(errno));
+            ret = COPY_ERROR;
+        }
+        // An unnamed file goes away with its fd, a hidden one must be removed
+        if (ret != COPY_DONE && temp[0] != '\0')
+            unlinkat(dest_dirfd, temp, 0);
+    }
+
+    // Only once every check has passed
+    if (ret == COPY_DONE && opts->verbose)
+        report(out, src_path, dest_path, &job);
+
+    if (ret == COPY_DONE && opts->stats != NULL) {
+        struct stat st;
+
+        __atomic_add_fetch(&opts->stats->files, 1, __ATOMIC_RELAXED);
+        __atomic_or_fetch(&opts->stats->methods, job.methods, __ATOMIC_RELAXED);
+        if (fstat(fd_dest, &st) == 0)
+            __atomic_add_fetch(&opts->stats->bytes, st.st_size, __ATOMIC_RELAXED);
+    }
+
+    if (ret == COPY_DONE && opts->checksum) {
+        char line[PATH_MAX + 32];
+        int len = snprintf(line, sizeof(line), "%08x  %s\n", job.crc, dest_path);
+        write(out, line, (len < (int) sizeof(line)) ? len : (int) sizeof(line));
+    }
+
+    close(fd_src);
+    close(fd_dest);
+    return (ret == COPY_DONE) ? 0 : 1;
+}
+
+/*
+ * Fan-out copy (--fan-out): one source, many destinations, each chunk read
+ * once. The calling thread reads into a ring of FAN_OUT_SLOTS buffers and
+ * every destination has a writer thread that follows it through the ring.
+ * A slot is only refilled once every writer still going is past it, so a
+ * slow destination holds the others back by at most the ring, and a failed
+ * one stops counting.
+ */
+
+struct fan_out;
+
+struct fan_out_writer {
+    struct fan_out *fo;
+    struct copy_job job;
+    const char *path;
+    unsigned long long next;    // chunk to write next
+    off_t written;
+    int failed;
+    int err;
+};
+
+struct fan_out {
+    char *buffers[FAN_OUT_SLOTS];
+    ssize_t lengths[FAN_OUT_SLOTS];
+    unsigned long long produced;    // chunks read so far
+    int done;                       // no more chunks are coming
+    struct fan_out_writer *writers;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;          // a chunk was read, or the reader is done
+    pthread_cond_t drained;         // a writer moved on, or failed
+};
+
+static void *fan_out_worker(void *arg)
+{
+    struct fan_out_writer *writer = arg;
+    struct fan_out *fo = writer->fo;
+
+    // Destinations that failed to open are set before the threads start
+    while (!writer->failed) {
+        const char *data;
+        ssize_t len, done = 0;
+
+        pthread_mutex_lock(&fo->lock);
+        while (writer->next == fo->produced && !fo->done)
+            pthread_cond_wait(&fo->filled, &fo->lock);
+        if (writer->next == fo->produced) {
+            pthread_mutex_unlock(&fo->lock);
+            break;
+        }
+        data = fo->buffers[writer->next % FAN_OUT_SLOTS];
+        len = fo->lengths[writer->next % FAN_OUT_SLOTS];
+        pthread_mutex_unlock(&fo->lock);
+
+        while (done < len) {
+            ssize_t n = job_write(&writer->job, data + done, len - done);
+
+            if (n <= 0) {
+                writer->err = (n < 0) ? errno : ENOSPC;
+                break;
+            }
+            done += n;
+        }
+
+        pthread_mutex_lock(&fo->lock);
+        writer->written += done;
+        if (done < len)
+            writer->failed = 1;
+        else
+            writer->next++;
+        pthread_cond_broadcast(&fo->drained);
+        pthread_mutex_unlock(&fo->lock);
+    }
+    return NULL;
+}
+
+// Wait until slot seq is free. 0 once no writer is left to write it.
+static int fan_out_wait(struct fan_out *fo, unsigned long long seq)
+{
+    int live;
+
+    pthread_mutex_lock(&fo->lock);
+    for (;;) {
+        int behind = 0;
+
+        live = 0;
+        for (int i = 0; i < fo->count; i++) {
+            if (!fo->writers[i].failed) {
+                live++;
+                if (fo->writers[i].next + FAN_OUT_SLOTS <= seq)
+                    behind = 1;
+            }
+        }
+        if (!behind || live == 0)
+            break;
+        pthread_cond_wait(&fo->drained, &fo->lock);
+    }
+    pthread_mutex_unlock(&fo->lock);
+    return live;
+}
+
+static int copy_fan_out(char *paths[], int count, const struct cp_options *opts)
+{
+    pthread_t threads[MAX_FAN_OUT];
+    struct fan_out_writer writers[MAX_FAN_OUT];
+    struct fan_out fo = {
+        .writers = writers,
+        .count = count - 1,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .filled = PTHREAD_COND_INITIALIZER,
+        .drained = PTHREAD_COND_INITIALIZER,
+    };
+    struct copy_job reader = { .fd_dest = -1, .opts = opts, .fd_journal = -1 };
+    const char *source = paths[0];
+    int out = STDOUT_FILENO, started, read_err = 0, ret = 0;
+    struct stat st;
+
+    if (count - 1 > MAX_FAN_OUT) {
+        fprintf(stderr, "cp: at most %d destinations with --fan-out\n", MAX_FAN_OUT);
+        return 1;
+    }
+
+    // - is stdout, once, and then messages have to stay out of the data
+    for (int i = 1; i < count; i++) {
+        if (strcmp(paths[i], "-") != 0)
+            continue;
+        if (out == STDERR_FILENO) {
+            fprintf(stderr, "cp: - given more than once with --fan-out\n");
+            return 1;
+        }
+        out = STDERR_FILENO;
+    }
+
+    reader.fd_src = (strcmp(source, "-") == 0) ? dup(STDIN_FILENO) : open(source, O_RDONLY);
+    if (reader.fd_src < 0 || fstat(reader.fd_src, &st) < 0 || S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "cp: cannot read '%s': %s\n", source,
+                (reader.fd_src >= 0 && S_ISDIR(st.st_mode)) ? strerror(EISDIR) : strerror(errno));
+        if (reader.fd_src >= 0)
+            close(reader.fd_src);
+        return 1;
+    }
+
+    for (int i = 0; i < FAN_OUT_SLOTS; i++) {
+        fo.buffers[i] = alloc_aligned(FAN_OUT_BUFSIZE, sysconf(_SC_PAGESIZE));
+        if (fo.buffers[i] == NULL)
+            read_err = ENOMEM;
+    }
+
+    // A destination that cannot be opened is failed from the start. Copies
+    // of a regular file get its mode, like those made by -r.
+    for (int i = 0; i < fo.count; i++) {
+        struct fan_out_writer *writer = &writers[i];
+        mode_t mode = S_ISREG(st.st_mode) ? st.st_mode & 07777 : 0644;
+        struct stat st_dest;
+
+        memset(writer, 0, sizeof(*writer));
+        writer->fo = &fo;
+        writer->path = paths[i + 1];
+        writer->job.fd_src = -1;
+        writer->job.opts = opts;
+        writer->job.fd_journal = -1;
+        writer->job.methods = 1u << METHOD_FAN_OUT;
+        if (strcmp(writer->path, "-") == 0)
+            writer->job.fd_dest = dup(STDOUT_FILENO);
+        else
+            writer->job.fd_dest = open(writer->path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+        if (writer->job.fd_dest < 0) {
+            writer->failed = 1;
+            writer->err = errno;
+        } else if (S_ISREG(st.st_mode) && st.st_size >= PREALLOC_MIN &&
+                   fstat(writer->job.fd_dest, &st_dest) == 0 && S_ISREG(st_dest.st_mode)) {
+            fallocate(writer->job.fd_dest, FALLOC_FL_KEEP_SIZE, 0, st.st_size);
+        }
+    }
+
+    for (started = 0; started < fo.count; started++) {
+        if (pthread_create(&threads[started], NULL, fan_out_worker, &writers[started]) != 0)
+            break;
+    }
+    for (int i = started; i < fo.count; i++) {
+        writers[i].failed = 1;
+        writers[i].err = EAGAIN;
+    }
+
+    for (unsigned long long seq = 0; !read_err && fan_out_wait(&fo, seq) > 0; seq++) {
+        ssize_t n = job_read(&reader, fo.buffers[seq % FAN_OUT_SLOTS], FAN_OUT_BUFSIZE);
+
+        if (n < 0)
+            read_err = errno;
+        if (n <= 0)
+            break;
+
+        pthread_mutex_lock(&fo.lock);
+        fo.lengths[seq % FAN_OUT_SLOTS] = n;
+        fo.produced++;
+        pthread_cond_broadcast(&fo.filled);
+        pthread_mutex_unlock(&fo.lock);
+    }
+
+    pthread_mutex_lock(&fo.lock);
+    fo.done = 1;
+    pthread_cond_broadcast(&fo.filled);
+    pthread_mutex_unlock(&fo.lock);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    if (read_err) {
+        fprintf(stderr, "cp: error reading '%s': %s\n", source, strerror(read_err));
+        ret = 1;
+    }
+
+    for (int i = 0; i < fo.count; i++) {
+        struct fan_out_writer *writer = &writers[i];
+
+        if (!writer->failed && opts->sync && fdatasync(writer->job.fd_dest) < 0 && errno != EINVAL) {
+            writer->failed = 1;
+            writer->err = errno;
+        }
+
+        if (writer->failed) {
+            fprintf(stderr, "cp: cannot write '%s': %s\n", writer->path, strerror(writer->err));
+            ret = 1;
+        } else if (!read_err) {
+            if (opts->verbose)
+                report(out, source, writer->path, &writer->job);
+            if (opts->stats != NULL) {
+                __atomic_add_fetch(&opts->stats->files, 1, __ATOMIC_RELAXED);
+                __atomic_or_fetch(&opts->stats->methods, writer->job.methods, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&opts->stats->bytes, writer->written, __ATOMIC_RELAXED);
+            }
+        }
+        if (writer->job.fd_dest >= 0)
+            close(writer->job.fd_dest);
+    }
+
+    for (int i = 0; i < FAN_OUT_SLOTS; i++)
+        free(fo.buffers[i]);
+    pthread_mutex_destroy(&fo.lock);
+    pthread_cond_destroy(&fo.filled);
+    pthread_cond_destroy(&fo.drained);
+    close(reader.fd_src);
+    return ret;
+}
+
+/*
+ * Recursive copy (-r).
+ *
+ * Directories and files are tasks run by a pool of worker threads. Each worker
+ * has its own deque: it pushes the tasks it creates (the entries of a
+ * directory it reads) and pops them from the bottom, and when it runs dry it
+ * steals from the top of the other workers' deques. Everything is opened with
+ * *at() calls relative to the parent directory fds, which are reference
+ * counted and closed once the last task that needs them is done.
+ *
+ * Hard links survive the copy: files with more than one name go in a map
+ * keyed by (st_dev, st_ino). The first name found is copied, the others are
+ * queued and recreated with linkat() once all copies are done, so the data
+ * is written only once and the links never race with the copy they need.
+ */
+
+struct dir_ref {
+    int fd;
+    int refs;
+};
+
+typedef enum {
+    TASK_DIR,
+    TASK_FILE
+} TaskType;
+
+struct task {
+    TaskType type;
+    struct dir_ref *src_dir;    // directories the names are relative to
+    struct dir_ref *dest_dir;
+    char *src_path;             // full paths, for messages and child paths
+    char *dest_path;
+    const char *src_name;       // last component of the paths
+    const char *dest_name;
+    mode_t mode;
+};
+
+struct deque {
+    pthread_mutex_t lock;
+    struct task **items;        // ring buffer, head is the top, tail the bottom
+    size_t head, tail, cap;
+};
+
+struct pool;
+
+struct worker {
+    struct pool *pool;
+    struct deque deque;
+    pthread_t thread;
+    int index;
+};
+
+struct inode_entry {
+    dev_t dev;
+    ino_t ino;
+    char *dest_path;            // the copy that later names link to
+    struct inode_entry *next;
+};
+
+struct hard_link {
+    const char *target;         // dest_path of the inode_entry
+    char *src_path;             // for messages
+    char *dest_path;
+    struct hard_link *next;
+};
+
+struct inode_map {
+    pthread_mutex_t lock;
+    struct inode_entry **buckets;
+    size_t nbuckets, count;
+    struct hard_link *links;
+};
+
+struct dir_mode {
+    char *path;
+    mode_t mode;
+    struct dir_mode *next;
+};
+
+struct pool {
+    struct worker *workers;
+    int nworkers;
+    pthread_mutex_t lock;       // idle workers sleep on wake
+    pthread_cond_t wake;
+    long pending;               // tasks queued or running
+    int idle;
+    int failed;
+    dev_t root_dev;             // the top destination directory, never descended into
+    ino_t root_ino;
+    struct inode_map inodes;    // files with more than one link
+    struct dir_mode *dir_modes; // created directories, newest first
+    const struct cp_options *opts;
+};
+
+static struct dir_ref *dir_ref_new(int fd)
+{
+    struct dir_ref *dir = malloc(sizeof(*dir));
+
+    if (dir != NULL) {
+        dir->fd = fd;
+        dir->refs = 1;
+    }
+    return dir;
+}
+
+static void dir_ref_get(struct dir_ref *dir)
+{
+    __atomic_add_fetch(&dir->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+static void dir_ref_put(struct dir_ref *dir)
+{
+    if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+        if (dir->fd >= 0)
+            close(dir->fd);
+        free(dir);
+    }
+}
+
+static void task_free(struct task *task)
+{
+    dir_ref_put(task->src_dir);
+    dir_ref_put(task->dest_dir);
+    free(task->src_path);
+    free(task->dest_path);
+    free(task);
+}
+
+static int deque_push(struct deque *dq, struct task *task)
+{
+    pthread_mutex_lock(&dq->lock);
+
+    if (dq->tail - dq->head == dq->cap) {
+        size_t cap = dq->cap ? dq->cap * 2 : 64;
+        struct task **items = malloc(cap * sizeof(*items));
+
+        if (items == NULL) {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+        for (size_t i = dq->head; i < dq->tail; i++)
+            items[i - dq->head] = dq->items[i % dq->cap];
+        free(dq->items);
+        dq->items = items;
+        dq->tail -= dq->head;
+        dq->head = 0;
+        dq->cap = cap;
+    }
+    dq->items[dq->tail++ % dq->cap] = task;
+
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+// The owner takes the newest task, which keeps its working set small
+static struct task *deque_pop(struct deque *dq)
+{
+    struct task *task = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail != dq->head)
+        task = dq->items[--dq->tail % dq->cap];
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+// Thieves take the oldest task, usually a whole directory
+static struct task *deque_steal(struct deque *dq)
+{
+    struct task *task = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail != dq->head)
+        task = dq->items[dq->head++ % dq->cap];
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+static struct task *find_task(struct worker *self)
+{
+    struct pool *pool = self->pool;
+    struct task *task = deque_pop(&self->deque);
+
+    for (int i = 1; task == NULL && i < pool->nworkers; i++)
+        task = deque_steal(&pool->workers[(self->index + i) % pool->nworkers].deque);
+
+    return task;
+}
+
+static void pool_failed(struct pool *pool, const char *path)
+{
+    fprintf(stderr, "cp: cannot copy '%s': %s\n", path, strerror(errno));
+    __atomic_store_n(&pool->failed, 1, __ATOMIC_SEQ_CST);
+}
+
+static size_t inode_hash(dev_t dev, ino_t ino, size_t nbuckets)
+{
+    return (size_t) ((uint64_t) dev * 0x9e3779b97f4a7c15ULL ^ (uint64_t) ino) % nbuckets;
+}
+
+static int inode_map_grow(struct inode_map *map)
+{
+    size_t nbuckets = map->nbuckets ? 2 * map->nbuckets : 64;
+    struct inode_entry **buckets = calloc(nbuckets, sizeof(*buckets));
+
+    if (buckets == NULL)
+        return -1;
+
+    for (size_t i = 0; i < map->nbuckets; i++) {
+        struct inode_entry *entry, *next;
+
+        for (entry = map->buckets[i]; entry != NULL; entry = next) {
+            size_t h = inode_hash(entry->dev, entry->ino, nbuckets);
+            next = entry->next;
+            entry->next = buckets[h];
+            buckets[h] = entry;
+        }
+    }
+
+    free(map->buckets);
+    map->buckets = buckets;
+    map->nbuckets = nbuckets;
+    return 0;
+}
+
+// Returns 1 when dest_path is a later name of an inode already being copied,
+// and has been queued to become a hard link to that copy. Returns 0 when the
+// caller should copy the file (the first name, or if we ran out of memory).
+static int remember_link(struct pool *pool, const struct stat *st,
+                         const char *src_path, const char *dest_path)
+{
+    struct inode_map *map = &pool->inodes;
+    struct inode_entry *entry;
+    struct hard_link *link;
+    int queued = 0;
+
+    pthread_mutex_lock(&map->lock);
+
+    if (map->count >= map->nbuckets && inode_map_grow(map) < 0 && map->nbuckets == 0)
+        goto out;
+
+    for (entry = map->buckets[inode_hash(st->st_dev, st->st_ino, map->nbuckets)];
+         entry != NULL; entry = entry->next) {
+        if (entry->dev == st->st_dev && entry->ino == st->st_ino)
+            break;
+    }
+
+    if (entry == NULL) {
+        size_t h = inode_hash(st->st_dev, st->st_ino, map->nbuckets);
+
+        entry = malloc(sizeof(*entry));
+        if (entry != NULL && (entry->dest_path = strdup(dest_path)) != NULL) {
+            entry->dev = st->st_dev;
+            entry->ino = st->st_ino;
+            entry->next = map->buckets[h];
+            map->buckets[h] = entry;
+            map->count++;
+        } else {
+            free(entry);
+        }
+        goto out;
+    }
+
+    link = malloc(sizeof(*link));
+    if (link != NULL) {
+        link->target = entry->dest_path;
+        link->src_path = strdup(src_path);
+        link->dest_path = strdup(dest_path);
+        if (link->src_path != NULL && link->dest_path != NULL) {
+            link->next = map->links;
+            map->links = link;
+            queued = 1;
+        } else {
+            free(link->src_path);
+            free(link->dest_path);
+            free(link);
+        }
+    }
+
+out:
+    pthread_mutex_unlock(&map->lock);
+    return queued;
+}
+
+// Create the queued hard links and free the map
+static void make_links(struct pool *pool)
 {
+    struct inode_map *map = &pool->inodes;
+    struct hard_link *link, *next;
 
-    if (argc != 3) {
-        write(STDERR_FILENO, "Usage: cp <source> <destination>\n", 34);
-        return 1;
+    for (link = map->links; link != NULL; link = next) {
+        // Replace what an earlier copy left there
+        if (link_replace(AT_FDCWD, link->target, 0, AT_FDCWD, link->dest_path) < 0) {
+            fprintf(stderr, "cp: cannot create hard link '%s' to '%s': %s\n",
+                    link->dest_path, link->target, strerror(errno));
+            pool->failed = 1;
+        } else if (pool->opts->verbose) {
+            char line[2 * PATH_MAX + 32];
+            int len = snprintf(line, sizeof(line), "'%s' -> '%s' (hard link)\n",
+                               link->src_path, link->dest_path);
+            write(STDOUT_FILENO, line, (len < (int) sizeof(line)) ? len : (int) sizeof(line));
+        }
+
+        next = link->next;
+        free(link->src_path);
+        free(link->dest_path);
+        free(link);
     }
 
-    int fd_src, fd_dest;
-    char buffer[BUFSIZE];
-    ssize_t bytes_read, bytes_written;
+    for (size_t i = 0; i < map->nbuckets; i++) {
+        struct inode_entry *entry, *next_entry;
 
-    fd_src = open(argv[1], O_RDONLY);
-    if (fd_src < 0) {
+        for (entry = map->buckets[i]; entry != NULL; entry = next_entry) {
+            next_entry = entry->next;
+            free(entry->dest_path);
+            free(entry);
+        }
+    }
+    free(map->buckets);
+    pthread_mutex_destroy(&map->lock);
+}
+
+// Directories are created writable so they can be filled; their own mode
+// is set once everything, hard links included, is in place
+static void remember_mode(struct pool *pool, const char *path, mode_t mode)
+{
+    struct dir_mode *dir = malloc(sizeof(*dir));
+
+    if (dir == NULL || (dir->path = strdup(path)) == NULL) {
+        free(dir);
+        errno = ENOMEM;
+        pool_failed(pool, path);
+        return;
+    }
+    dir->mode = mode;
+
+    pthread_mutex_lock(&pool->lock);
+    dir->next = pool->dir_modes;
+    pool->dir_modes = dir;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Children come before their parents, which may not be searchable after
+static void restore_modes(struct pool *pool)
+{
+    struct dir_mode *dir, *next;
+
+    for (dir = pool->dir_modes; dir != NULL; dir = next) {
+        if (chmod(dir->path, dir->mode) < 0) {
+            fprintf(stderr, "cp: cannot set mode of '%s': %s\n", dir->path, strerror(errno));
+            pool->failed = 1;
+        }
+        next = dir->next;
+        free(dir->path);
+        free(dir);
+    }
+}
+
+static void submit(struct worker *self, struct task *task)
+{
+    struct pool *pool = self->pool;
+
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    if (deque_push(&self->deque, task) < 0) {
+        errno = ENOMEM;
+        pool_failed(pool, task->src_path);
+        task_free(task);
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+        return;
+    }
+
+    if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+    size_t len = strlen(dir);
+    char *path = malloc(len + strlen(name) + 2);
+
+    if (path != NULL)
+        sprintf(path, (len > 0 && dir[len - 1] == '/') ? "%s%s" : "%s/%s", dir, name);
+    return path;
+}
+
+static struct task *task_new(TaskType type, struct dir_ref *src_dir, struct dir_ref *dest_dir,
+                             const char *src_path, const char *dest_path, mode_t mode)
+{
+    struct task *task = calloc(1, sizeof(*task));
+
+    if (task == NULL)
+        return NULL;
+
+    task->src_path = strdup(src_path);
+    task->dest_path = strdup(dest_path);
+    if (task->src_path == NULL || task->dest_path == NULL) {
+        free(task->src_path);
+        free(task->dest_path);
+        free(task);
+        return NULL;
+    }
+
+    task->type = type;
+    task->src_dir = src_dir;
+    task->dest_dir = dest_dir;
+    task->mode = mode;
+    dir_ref_get(src_dir);
+    dir_ref_get(dest_dir);
+
+    // Below the top directory names are single components
+    if (src_dir->fd == AT_FDCWD) {
+        task->src_name = task->src_path;
+        task->dest_name = task->dest_path;
+    } else {
+        task->src_name = strrchr(task->src_path, '/') + 1;
+        task->dest_name = strrchr(task->dest_path, '/') + 1;
+    }
+    return task;
+}
+
+static int copy_symlink(struct dir_ref *src_dir, struct dir_ref *dest_dir, const char *name)
+{
+    char target[PATH_MAX];
+    ssize_t len = readlinkat(src_dir->fd, name, target, sizeof(target) - 1);
+
+    if (len < 0)
+        return -1;
+    target[len] = '\0';
+
+    if (symlinkat(target, dest_dir->fd, name) < 0 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+static void run_dir_task(struct worker *self, struct task *task)
+{
+    struct pool *pool = self->pool;
+    struct dir_ref *src_dir, *dest_dir;
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+    int fd;
+
+    fd = openat(task->src_dir->fd, task->src_name, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        pool_failed(pool, task->src_path);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    // Don't copy the destination into itself (cp -r dir dir/sub). The rest
+    // is still copied, but like cp(1) this is an error.
+    if (task->src_dir->fd != AT_FDCWD &&
+        st.st_dev == pool->root_dev && st.st_ino == pool->root_ino) {
+        fprintf(stderr, "cp: cannot copy a directory into itself, '%s'\n", task->src_path);
+        __atomic_store_n(&pool->failed, 1, __ATOMIC_SEQ_CST);
+        close(fd);
+        return;
+    }
+
+    src_dir = dir_ref_new(fd);
+    if (src_dir == NULL) {
+        close(fd);
+        pool_failed(pool, task->src_path);
+        return;
+    }
+
+    // Make sure we can fill the directory even if the source is read-only
+    if (mkdirat(task->dest_dir->fd, task->dest_name, (st.st_mode & 07777) | S_IRWXU) == 0) {
+        remember_mode(pool, task->dest_path, st.st_mode & 07777);
+    } else if (errno != EEXIST) {
+        pool_failed(pool, task->dest_path);
+        dir_ref_put(src_dir);
+        return;
+    }
+
+    fd = openat(task->dest_dir->fd, task->dest_name, O_RDONLY | O_DIRECTORY);
+    dest_dir = (fd >= 0) ? dir_ref_new(fd) : NULL;
+    if (dest_dir == NULL) {
+        pool_failed(pool, task->dest_path);
+        if (fd >= 0)
+            close(fd);
+        dir_ref_put(src_dir);
+        return;
+    }
+
+    // fdopendir() owns its fd, the children need one of their own
+    fd = dup(src_dir->fd);
+    dir = (fd >= 0) ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        pool_failed(pool, task->src_path);
+        if (fd >= 0)
+            close(fd);
+        dir_ref_put(src_dir);
+        dir_ref_put(dest_dir);
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned char type = entry->d_type;
+        struct task *child;
+        char *src_path, *dest_path;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        if (type == DT_UNKNOWN || type == DT_REG) {
+            if (fstatat(src_dir->fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                pool_failed(pool, task->src_path);
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG :
+                   S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+        }
+
+        if (type == DT_LNK) {
+            if (copy_symlink(src_dir, dest_dir, entry->d_name) < 0) {
+                src_path = join_path(task->src_path, entry->d_name);
+                pool_failed(pool, src_path ? src_path : task->src_path);
+                free(src_path);
+            }
+            continue;
+        }
+
+        if (type != DT_DIR && type != DT_REG) {
+            fprintf(stderr, "cp: skipping special file '%s/%s'\n", task->src_path, entry->d_name);
+            continue;
+        }
+
+        src_path = join_path(task->src_path, entry->d_name);
+        dest_path = join_path(task->dest_path, entry->d_name);
+
+        if (type == DT_REG && st.st_nlink > 1 && src_path && dest_path &&
+            remember_link(pool, &st, src_path, dest_path)) {
+            free(src_path);
+            free(dest_path);
+            continue;
+        }
+
+        child = (src_path && dest_path) ?
+                task_new(type == DT_DIR ? TASK_DIR : TASK_FILE, src_dir, dest_dir,
+                         src_path, dest_path, (type == DT_REG) ? st.st_mode & 07777 : 0) :
+                NULL;
+
+        if (child == NULL) {
+            errno = ENOMEM;
+            pool_failed(pool, task->src_path);
+        } else {
+            submit(self, child);
+        }
+        free(src_path);
+        free(dest_path);
+    }
+
+    closedir(dir);
+    dir_ref_put(src_dir);
+    dir_ref_put(dest_dir);
+}
+
+static void run_file_task(struct worker *self, struct task *task)
+{
+    if (copy_one(task->src_dir->fd, task->src_name, task->dest_dir->fd, task->dest_name,
+                 task->mode, self->pool->opts, task->src_path, task->dest_path) != 0)
+        pool_failed(self->pool, task->src_path);
+}
+
+static void *worker_loop(void *arg)
+{
+    struct worker *self = arg;
+    struct pool *pool = self->pool;
+    struct task *task;
+
+    for (;;) {
+        task = find_task(self);
+
+        if (task == NULL) {
+            // Nothing to steal: sleep until a task is submitted or all are done
+            pthread_mutex_lock(&pool->lock);
+            __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) > 0 &&
+                   (task = find_task(self)) == NULL)
+                pthread_cond_wait(&pool->wake, &pool->lock);
+            __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&pool->lock);
+
+            if (task == NULL)
+                break;
+        }
+
+        if (task->type == TASK_DIR)
+            run_dir_task(self, task);
+        else
+            run_file_task(self, task);
+        task_free(task);
+
+        if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_broadcast(&pool->wake);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+
+    return NULL;
+}
+
+static int copy_tree(const char *source, const char *destination, const struct cp_options *opts)
+{
+    struct pool pool = {
+        .nworkers = opts->jobs,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .wake = PTHREAD_COND_INITIALIZER,
+        .inodes = { .lock = PTHREAD_MUTEX_INITIALIZER },
+        .opts = opts,
+    };
+    struct dir_ref *cwd;
+    struct task *root;
+    struct stat st;
+    int i;
+
+    pool.workers = calloc(pool.nworkers, sizeof(*pool.workers));
+    cwd = dir_ref_new(AT_FDCWD);
+    root = cwd ? task_new(TASK_DIR, cwd, cwd, source, destination, 0) : NULL;
+    if (cwd != NULL)
+        dir_ref_put(cwd);       // the root task holds it now
+    if (pool.workers == NULL || root == NULL) {
+        free(pool.workers);
+        if (root != NULL)
+            task_free(root);
         return 1;
     }
 
-    fd_dest = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd_dest < 0) {
-        close(fd_src);
+    // Create the top directory first so the walk can recognize it
+    if (stat(source, &st) == 0) {
+        if (mkdir(destination, (st.st_mode & 07777) | S_IRWXU) == 0)
+            remember_mode(&pool, destination, st.st_mode & 07777);
+        if (stat(destination, &st) == 0) {
+            pool.root_dev = st.st_dev;
+            pool.root_ino = st.st_ino;
+        }
+    }
+
+    for (i = 0; i < pool.nworkers; i++) {
+        pool.workers[i].pool = &pool;
+        pool.workers[i].index = i;
+        pthread_mutex_init(&pool.workers[i].deque.lock, NULL);
+    }
+
+    pool.pending = 1;
+    if (deque_push(&pool.workers[0].deque, root) < 0) {
+        task_free(root);
+        free(pool.workers);
+        restore_modes(&pool);
         return 1;
     }
 
-    while ((bytes_read = read(fd_src, buffer, sizeof(buffer))) > 0) {
-        bytes_written = write(fd_dest, buffer, bytes_read);
-        if (bytes_written != bytes_read) {
-            close(fd_src);
-            close(fd_dest);
-            return 1;
+    // The calling thread is worker 0. A worker that fails to start just
+    // leaves its (empty) deque alone.
+    for (i = 1; i < pool.nworkers; i++) {
+        if (pthread_create(&pool.workers[i].thread, NULL, worker_loop, &pool.workers[i]) != 0)
+            pool.workers[i].index = -1;
+    }
+    worker_loop(&pool.workers[0]);
+
+    for (i = 1; i < pool.nworkers; i++) {
+        if (pool.workers[i].index >= 0)
+            pthread_join(pool.workers[i].thread, NULL);
+    }
+
+    for (i = 0; i < pool.nworkers; i++) {
+        free(pool.workers[i].deque.items);
+        pthread_mutex_destroy(&pool.workers[i].deque.lock);
+    }
+    free(pool.workers);
+
+    make_links(&pool);
+    restore_modes(&pool);
+
+    return pool.failed ? 1 : 0;
+}
+
+// Options that only have a long form
+enum {
+    OPT_SPARSE = 256,
+    OPT_REFLINK,
+    OPT_STRATEGY,
+    OPT_DIRECT,
+    OPT_QUEUE_DEPTH,
+    OPT_CHECKSUM,
+    OPT_VERIFY,
+    OPT_EXPECT,
+    OPT_INCREMENTAL,
+    OPT_RESUME,
+    OPT_BUFFER_SIZE,
+    OPT_STATS,
+    OPT_BWLIMIT,
+    OPT_IOPS,
+    OPT_BURST,
+    OPT_UPDATE,
+    OPT_FAN_OUT,
+    OPT_ATOMIC,
+    OPT_SYNC,
+    OPT_CALIBRATE
+};
+
+// A byte count with an optional K, M or G suffix
+static int parse_size(const char *arg, unsigned long long *size)
+{
+    unsigned long long value;
+    char *end;
+    int shift = 0;
+
+    errno = 0;
+    value = strtoull(arg, &end, 10);
+    if (*end == 'K' || *end == 'k')
+        shift = 10;
+    else if (*end == 'M' || *end == 'm')
+        shift = 20;
+    else if (*end == 'G' || *end == 'g')
+        shift = 30;
+    if (shift)
+        end++;
+
+    if (*arg < '0' || *arg > '9' || *end != '\0' || errno != 0 || value > (~0ULL >> shift))
+        return -1;
+    *size = value << shift;
+    return 0;
+}
+
+static int parse_options(int argc, char *argv[], struct cp_options *opts)
+{
+    static const struct option long_options[] = {
+        {"sparse", required_argument, NULL, OPT_SPARSE},
+        {"reflink", optional_argument, NULL, OPT_REFLINK},
+        {"strategy", required_argument, NULL, OPT_STRATEGY},
+        {"direct", no_argument, NULL, OPT_DIRECT},
+        {"queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH},
+        {"checksum", no_argument, NULL, OPT_CHECKSUM},
+        {"verify", no_argument, NULL, OPT_VERIFY},
+        {"expect", required_argument, NULL, OPT_EXPECT},
+        {"incremental", no_argument, NULL, OPT_INCREMENTAL},
+        {"resume", no_argument, NULL, OPT_RESUME},
+        {"buffer-size", required_argument, NULL, OPT_BUFFER_SIZE},
+        {"stats", optional_argument, NULL, OPT_STATS},
+        {"bwlimit", required_argument, NULL, OPT_BWLIMIT},
+        {"iops", required_argument, NULL, OPT_IOPS},
+        {"burst", required_argument, NULL, OPT_BURST},
+        {"update", optional_argument, NULL, OPT_UPDATE},
+        {"fan-out", no_argument, NULL, OPT_FAN_OUT},
+        {"atomic", no_argument, NULL, OPT_ATOMIC},
+        {"sync", no_argument, NULL, OPT_SYNC},
+        {"calibrate", no_argument, NULL, OPT_CALIBRATE},
+        {"recursive", no_argument, NULL, 'r'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"verbose", no_argument, NULL, 'v'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+
+    opts->sparse = SPARSE_AUTO;
+    opts->reflink = REFLINK_AUTO;
+    opts->strategy = STRATEGY_AUTO;
+    opts->queue_depth = URING_DEPTH;
+    opts->buffer_size = BUFSIZE;
+    opts->checksum = 0;
+    opts->verify = 0;
+    opts->expect_set = 0;
+    opts->incremental = 0;
+    opts->resume = 0;
+    opts->update = UPDATE_NONE;
+    opts->fan_out = 0;
+    opts->atomic = 0;
+    opts->sync = 0;
+    opts->calibrate = 0;
+    opts->tuning = NULL;
+    opts->recursive = 0;
+    opts->jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    opts->verbose = 0;
+    opts->bwlimit = 0;
+    opts->iops = 0;
+    opts->burst = 0;
+    opts->limit = NULL;
+    opts->report_stats = 0;
+    opts->stats_file = NULL;
+    opts->stats = NULL;
+
+    if (opts->jobs < 1)
+        opts->jobs = 1;
+    if (opts->jobs > MAX_JOBS)
+        opts->jobs = MAX_JOBS;
+
+    optind = 0;     // cp_main may run more than once in a process
+    while ((opt = getopt_long(argc, argv, "rRj:uv", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_SPARSE:
+            if (strcmp(optarg, "auto") == 0)
+                opts->sparse = SPARSE_AUTO;
+            else if (strcmp(optarg, "always") == 0)
+                opts->sparse = SPARSE_ALWAYS;
+            else if (strcmp(optarg, "never") == 0)
+                opts->sparse = SPARSE_NEVER;
+            else
+                return -1;
+            break;
+        case OPT_REFLINK:
+            if (optarg == NULL || strcmp(optarg, "always") == 0)
+                opts->reflink = REFLINK_ALWAYS;
+            else if (strcmp(optarg, "auto") == 0)
+                opts->reflink = REFLINK_AUTO;
+            else if (strcmp(optarg, "never") == 0)
+                opts->reflink = REFLINK_NEVER;
+            else
+                return -1;
+            break;
+        case OPT_STRATEGY:
+            opts->strategy = STRATEGY_COUNT;
+            for (int i = 0; i < STRATEGY_COUNT; i++) {
+                if (strcmp(optarg, strategy_names[i]) == 0)
+                    opts->strategy = (Strategy) i;
+            }
+            if (opts->strategy == STRATEGY_COUNT)
+                return -1;
+            break;
+        case OPT_DIRECT:
+            opts->strategy = STRATEGY_DIRECT;
+            break;
+        case OPT_CHECKSUM:
+            opts->checksum = 1;
+            break;
+        case OPT_VERIFY:
+            opts->verify = 1;
+            break;
+        case OPT_EXPECT: {
+            char *end;
+            unsigned long crc = strtoul(optarg, &end, 16);
+            if (*optarg == '\0' || *end != '\0' || crc > 0xffffffffUL)
+                return -1;
+            opts->expect = crc;
+            opts->expect_set = 1;
+            break;
+        }
+        case OPT_INCREMENTAL:
+            opts->incremental = 1;
+            break;
+        case OPT_RESUME:
+            opts->resume = 1;
+            break;
+        case OPT_UPDATE:
+            if (optarg == NULL || strcmp(optarg, "quick") == 0)
+                opts->update = UPDATE_QUICK;
+            else if (strcmp(optarg, "sample") == 0)
+                opts->update = UPDATE_SAMPLE;
+            else
+                return -1;
+            break;
+        case 'u':
+            opts->update = UPDATE_QUICK;
+            break;
+        case OPT_FAN_OUT:
+            opts->fan_out = 1;
+            break;
+        case OPT_ATOMIC:
+            opts->atomic = 1;
+            break;
+        case OPT_SYNC:
+            opts->sync = 1;
+            break;
+        case OPT_CALIBRATE:
+            opts->calibrate = 1;
+            break;
+        case OPT_STATS:
+            opts->report_stats = 1;
+            opts->stats_file = optarg;
+            break;
+        case OPT_BUFFER_SIZE: {
+            unsigned long long size;
+            if (parse_size(optarg, &size) < 0 || size < 1 || size > MAX_BUFSIZE)
+                return -1;
+            opts->buffer_size = size;
+            break;
+        }
+        case OPT_BWLIMIT:
+            if (parse_size(optarg, &opts->bwlimit) < 0 || opts->bwlimit == 0)
+                return -1;
+            break;
+        case OPT_BURST:
+            if (parse_size(optarg, &opts->burst) < 0 || opts->burst == 0)
+                return -1;
+            break;
+        case OPT_IOPS:
+            if (parse_size(optarg, &opts->iops) < 0 || opts->iops == 0)
+                return -1;
+            break;
+        case OPT_QUEUE_DEPTH:
+            opts->queue_depth = atoi(optarg);
+            if (opts->queue_depth < 1 || opts->queue_depth > MAX_URING_DEPTH)
+                return -1;
+            break;
+        case 'r':
+        case 'R':
+            opts->recursive = 1;
+            break;
+        case 'j':
+            opts->jobs = atoi(optarg);
+            if (opts->jobs < 1 || opts->jobs > MAX_JOBS)
+                return -1;
+            break;
+        case 'v':
+            opts->verbose = 1;
+            break;
+        default:
+            return -1;
         }
     }
 
-    if (bytes_read < 0) {
-        close(fd_src);
-        close(fd_dest);
+    // --fan-out streams one file, none of the options below apply to it
+    if (opts->fan_out && (opts->recursive || opts->checksum || opts->verify ||
+                          opts->expect_set || opts->incremental || opts->resume ||
+                          opts->update != UPDATE_NONE || opts->atomic))
+        return -1;
+
+    // Those two update the destination in place
+    if (opts->atomic && (opts->incremental || opts->resume))
+        return -1;
+
+    return 0;
+}
+
+// Last component of path, ignoring trailing slashes
+static char *base_name(const char *path)
+{
+    char *copy = strdup(path);
+    char *end, *slash;
+
+    if (copy == NULL)
+        return NULL;
+
+    end = copy + strlen(copy);
+    while (end > copy + 1 && end[-1] == '/')
+        *--end = '\0';
+
+    slash = strrchr(copy, '/');
+    if (slash != NULL && slash[1] != '\0')
+        memmove(copy, slash + 1, strlen(slash + 1) + 1);
+    return copy;
+}
+
+static int copy_directory(const char *source, const char *destination,
+                          const struct cp_options *opts)
+{
+    struct stat st;
+    char *name, *target;
+    int ret;
+
+    if (!opts->recursive) {
+        fprintf(stderr, "cp: -r not specified; omitting directory '%s'\n", source);
         return 1;
     }
 
-    close(fd_src);
-    close(fd_dest);
+    // Like cp(1): an existing directory receives a copy named after the source
+    if (stat(destination, &st) < 0 || !S_ISDIR(st.st_mode))
+        return copy_tree(source, destination, opts);
+
+    name = base_name(source);
+    target = name ? join_path(destination, name) : NULL;
+    ret = target ? copy_tree(source, target, opts) : 1;
+
+    free(name);
+    free(target);
+    return ret;
+}
+
+// Copy each source into the directory destination. The directory is
+// resolved once; every file is then created relative to its fd.
+static int copy_into_directory(char *sources[], int count, const char *destination,
+                               const struct cp_options *opts)
+{
+    int dirfd, ret = 0;
+
+    dirfd = open(destination, O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0) {
+        fprintf(stderr, "cp: target '%s' is not a directory\n", destination);
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        char *name = base_name(sources[i]);
+        char *dest_path = name ? join_path(destination, name) : NULL;
+        struct stat st;
+
+        if (dest_path == NULL)
+            ret = 1;
+        else if (stat(sources[i], &st) == 0 && S_ISDIR(st.st_mode))
+            ret |= copy_directory(sources[i], destination, opts);
+        else
+            ret |= copy_one(AT_FDCWD, sources[i], dirfd, name, 0644, opts, sources[i], dest_path);
+
+        free(name);
+        free(dest_path);
+    }
+
+    close(dirfd);
+    return ret;
+}
+
+// Where the calibrated table is kept
+static int tuning_path(char *path, size_t size)
+{
+    const char *env = getenv("CP_TUNING_FILE");
+    int len;
+
+    if (env != NULL && *env != '\0')
+        len = snprintf(path, size, "%s", env);
+    else if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env != '\0')
+        len = snprintf(path, size, "%s/" TUNING_FILE, env);
+    else if ((env = getenv("HOME")) != NULL && *env != '\0')
+        len = snprintf(path, size, "%s/.cache/" TUNING_FILE, env);
+    else
+        return -1;
+    return (len < (int) size) ? 0 : -1;
+}
+
+// One row per line: f_type in hex, same or other device, size class,
+// strategy. Lines that don't parse are skipped.
+static void load_tuning(struct tuning_table *table)
+{
+    char path[PATH_MAX], line[256], device[16], size[16], strategy[32];
+    unsigned long fs_type;
+    FILE *fp;
+
+    table->count = 0;
+    if (tuning_path(path, sizeof(path)) < 0 || (fp = fopen(path, "r")) == NULL)
+        return;
+
+    while (table->count < MAX_TUNING && fgets(line, sizeof(line), fp) != NULL) {
+        struct tuning row = { .same_device = -1, .size = SIZE_CLASSES, .strategy = STRATEGY_COUNT };
+
+        if (line[0] == '#' ||
+            sscanf(line, "%lx %15s %15s %31s", &fs_type, device, size, strategy) != 4)
+            continue;
+
+        row.fs_type = fs_type;
+        if (strcmp(device, "same") == 0 || strcmp(device, "other") == 0)
+            row.same_device = strcmp(device, "same") == 0;
+        for (int i = 0; i < SIZE_CLASSES; i++) {
+            if (strcmp(size, size_names[i]) == 0)
+                row.size = (SizeClass) i;
+        }
+        for (int i = 0; i < STRATEGY_COUNT; i++) {
+            if (strcmp(strategy, strategy_names[i]) == 0)
+                row.strategy = (Strategy) i;
+        }
+        if (row.fs_type != 0 && row.same_device >= 0 && row.size != SIZE_CLASSES &&
+            row.strategy != STRATEGY_COUNT)
+            table->rows[table->count++] = row;
+    }
+    fclose(fp);
+}
+
+// Write the table to a new file and rename it over the old one
+static int save_tuning(const struct tuning_table *table)
+{
+    char path[PATH_MAX], temp[PATH_MAX + 16], dir[PATH_MAX];
+    FILE *fp;
+
+    if (tuning_path(path, sizeof(path)) < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    parent_dir(path, dir, sizeof(dir));
+    mkdir(dir, 0755);
+
+    snprintf(temp, sizeof(temp), "%s.%d", path, (int) getpid());
+    if ((fp = fopen(temp, "w")) == NULL)
+        return -1;
+
+    fprintf(fp, "# cp --calibrate: f_type device size strategy\n");
+    for (int i = 0; i < table->count; i++) {
+        const struct tuning *row = &table->rows[i];
+
+        fprintf(fp, "%lx %s %s %s\n", row->fs_type, row->same_device ? "same" : "other",
+                size_names[row->size], strategy_names[row->strategy]);
+    }
+    if (fclose(fp) != 0 || rename(temp, path) < 0) {
+        unlink(temp);
+        return -1;
+    }
     return 0;
 }
+
+// The strategies cp --calibrate times. direct and stream are about what
+// stays in the page cache more than about speed, so they are left out.
+static const Strategy calibrated_strategies[] = {
+    STRATEGY_AUTO, STRATEGY_SENDFILE, STRATEGY_READ_WRITE, STRATEGY_MMAP,
+    STRATEGY_IO_URING, STRATEGY_THREADS, STRATEGY_PIPELINE
+};
+
+// Fill name (in dirfd) with size bytes
+static int write_sample(int dirfd, const char *name, off_t size, const char *buffer)
+{
+    int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd < 0)
+        return -1;
+    for (off_t done = 0; done < size; done += SMALL_FILE) {
+        size_t n = chunk(size - done, SMALL_FILE);
+
+        if (write(fd, buffer, n) != (ssize_t) n) {
+            close(fd);
+            return -1;
+        }
+    }
+    return close(fd);
+}
+
+/*
+ * cp --calibrate: copy a file of each size class from source to destination
+ * (both directories) with every strategy, warm cache, and keep the fastest
+ * in the tuning file for the destination file system and the device pair.
+ * Rows for other file systems are kept.
+ */
+static int calibrate(const char *source, const char *destination, const struct cp_options *opts)
+{
+    static const off_t sizes[SIZE_CLASSES] = { 256 << 10, 8 << 20, LARGE_FILE };
+    const char *src_name = ".cp-calibrate", *dest_name = ".cp-calibrate.out";
+    struct cp_options copts = *opts;
+    struct tuning_table table;
+    struct stat st_src, st_dest;
+    struct statfs sfs;
+    char path[PATH_MAX];
+    char *buffer = NULL;
+    int src_dirfd, dest_dirfd, same_device, ret = 1;
+
+    // Time the data path alone
+    copts.strategy = STRATEGY_AUTO;
+    copts.reflink = REFLINK_NEVER;
+    copts.sparse = SPARSE_NEVER;
+    copts.checksum = copts.verify = copts.expect_set = 0;
+    copts.incremental = copts.resume = copts.atomic = copts.sync = 0;
+    copts.update = UPDATE_NONE;
+    copts.verbose = 0;
+    copts.limit = NULL;
+    copts.stats = NULL;
+    copts.tuning = NULL;
+
+    src_dirfd = open(source, O_RDONLY | O_DIRECTORY);
+    dest_dirfd = open(destination, O_RDONLY | O_DIRECTORY);
+    if (src_dirfd < 0 || dest_dirfd < 0 || fstat(src_dirfd, &st_src) < 0 ||
+        fstat(dest_dirfd, &st_dest) < 0 || fstatfs(dest_dirfd, &sfs) < 0 ||
+        (buffer = malloc(SMALL_FILE)) == NULL) {
+        fprintf(stderr, "cp: cannot calibrate '%s' -> '%s': %s\n", source, destination,
+                strerror(errno));
+        goto out;
+    }
+    same_device = st_src.st_dev == st_dest.st_dev;
+    for (size_t i = 0; i < SMALL_FILE; i++)
+        buffer[i] = (char) (i * 131 + (i >> 12));
+
+    load_tuning(&table);
+
+    for (int size = 0; size < SIZE_CLASSES; size++) {
+        Strategy best = STRATEGY_COUNT;
+        long long best_ns = 0;
+        struct tuning row = {
+            .fs_type = sfs.f_type,
+            .same_device = same_device,
+            .size = (SizeClass) size,
+        };
+        int i;
+
+        if (write_sample(src_dirfd, src_name, sizes[size], buffer) < 0) {
+            fprintf(stderr, "cp: cannot write '%s/%s': %s\n", source, src_name, strerror(errno));
+            goto out;
+        }
+
+        for (size_t s = 0; s < sizeof(calibrated_strategies) / sizeof(calibrated_strategies[0]); s++) {
+            long long ns = 0;
+
+            copts.strategy = calibrated_strategies[s];
+            for (int run = 0; run < CALIBRATION_RUNS; run++) {
+                long long start = now_ns();
+
+                if (copy_one(src_dirfd, src_name, dest_dirfd, dest_name, 0600, &copts,
+                             src_name, dest_name) != 0) {
+                    ns = 0;
+                    break;
+                }
+                if (run == 0 || now_ns() - start < ns)
+                    ns = now_ns() - start;
+            }
+            if (opts->verbose && ns > 0)
+                printf("%s %s: %s %.0f MB/s\n", size_names[size], same_device ? "same" : "other",
+                       strategy_names[copts.strategy], sizes[size] * 1e3 / ns);
+            if (ns > 0 && (best == STRATEGY_COUNT || ns < best_ns)) {
+                best = copts.strategy;
+                best_ns = ns;
+            }
+        }
+        if (best == STRATEGY_COUNT) {
+            fprintf(stderr, "cp: no strategy could copy to '%s'\n", destination);
+            goto out;
+        }
+
+        row.strategy = best;
+        printf("%lx %s %s %s (%.0f MB/s)\n", row.fs_type, same_device ? "same" : "other",
+               size_names[size], strategy_names[best], sizes[size] * 1e3 / best_ns);
+
+        // Replace the row for this key, or add one; a full table loses its last row
+        for (i = 0; i < table.count; i++) {
+            if (table.rows[i].fs_type == row.fs_type && table.rows[i].same_device == same_device &&
+                table.rows[i].size == row.size)
+                break;
+        }
+        if (i == MAX_TUNING)
+            i--;
+        table.rows[i] = row;
+        if (i == table.count)
+            table.count++;
+    }
+
+    if (save_tuning(&table) < 0) {
+        tuning_path(path, sizeof(path));
+        fprintf(stderr, "cp: cannot save '%s': %s\n", path, strerror(errno));
+        goto out;
+    }
+    ret = 0;
+
+out:
+    if (src_dirfd >= 0) {
+        unlinkat(src_dirfd, src_name, 0);
+        close(src_dirfd);
+    }
+    if (dest_dirfd >= 0) {
+        unlinkat(dest_dirfd, dest_name, 0);
+        close(dest_dirfd);
+    }
+    free(buffer);
+    return ret;
+}
+
+// Write the --stats counters as one line of JSON
+static void print_stats(const struct cp_options *opts, long long elapsed)
+{
+    const struct copy_stats *stats = opts->stats;
+    const char *sep = "";
+    FILE *out = stderr;
+
+    if (opts->stats_file != NULL && (out = fopen(opts->stats_file, "w")) == NULL) {
+        fprintf(stderr, "cp: cannot write stats to '%s': %s\n", opts->stats_file, strerror(errno));
+        return;
+    }
+
+    fprintf(out, "{\"tool\": \"cp\", \"strategy\": \"%s\", \"methods\": [",
+            strategy_names[opts->strategy]);
+    for (int i = 0; i < METHOD_COUNT; i++) {
+        if (stats->methods & (1u << i)) {
+            fprintf(out, "%s\"%s\"", sep, method_names[i]);
+            sep = ", ";
+        }
+    }
+    fprintf(out, "], \"files\": %llu, \"bytes\": %llu, \"skipped\": %llu, \"elapsed_ns\": %lld, "
+            "\"mb_per_s\": %.1f", stats->files, stats->bytes, stats->skipped, elapsed,
+            elapsed > 0 ? stats->bytes * 1e3 / elapsed : 0.0);
+
+    for (int kind = 0; kind < CALL_KINDS; kind++) {
+        const struct call_stats *cs = &stats->calls[kind];
+
+        fprintf(out, ", \"%s\": {\"calls\": %llu, \"short\": %llu, \"bytes\": %llu, "
+                "\"time_ns\": %llu, \"latency_us\": {", call_names[kind],
+                cs->calls, cs->short_calls, cs->bytes, cs->ns);
+        sep = "";
+        for (int i = 0; i < STATS_BUCKETS; i++) {
+            if (cs->latency[i] > 0) {
+                fprintf(out, "%s\"%llu\": %llu", sep, 1ULL << i, cs->latency[i]);
+                sep = ", ";
+            }
+        }
+        fprintf(out, "}}");
+    }
+    fprintf(out, "}\n");
+
+    if (out != stderr)
+        fclose(out);
+}
+
+static int run_copy(int argc, char *argv[], const struct cp_options *opts)
+{
+    const char *source = argv[optind];
+    const char *destination = argv[argc - 1];
+    struct stat st, st_dest;
+
+    if (opts->fan_out)
+        return copy_fan_out(argv + optind, argc - optind, opts);
+
+    if (argc - optind > 2)
+        return copy_into_directory(argv + optind, argc - optind - 1, destination, opts);
+
+    if (stat(source, &st) == 0 && S_ISDIR(st.st_mode))
+        return copy_directory(source, destination, opts);
+
+    // Like cp(1): a file copied onto a directory lands inside it
+    if (stat(destination, &st_dest) == 0 && S_ISDIR(st_dest.st_mode))
+        return copy_into_directory(argv + optind, 1, destination, opts);
+
+    return copy_one(AT_FDCWD, source, AT_FDCWD, destination, 0644, opts,
+                    source, destination);
+}
+
+int cp_main(int argc, char *argv[])
+{
+    struct cp_options opts;
+    struct copy_stats stats;
+    struct rate_limit limit;
+    struct tuning_table tuning;
+    long long start = now_ns();
+    int ret;
+
+    if (parse_options(argc, argv, &opts) < 0 || argc - optind < 2 ||
+        (opts.calibrate && argc - optind != 2)) {
+        write(STDERR_FILENO, usage_msg, sizeof(usage_msg) - 1);
+        return 1;
+    }
+
+    if (opts.calibrate)
+        return calibrate(argv[optind], argv[optind + 1], &opts);
+
+    if (opts.strategy == STRATEGY_AUTO) {
+        load_tuning(&tuning);
+        opts.tuning = &tuning;
+    }
+
+    if (opts.report_stats) {
+        memset(&stats, 0, sizeof(stats));
+        opts.stats = &stats;
+    }
+
+    if (opts.bwlimit || opts.iops) {
+        rate_limit_init(&limit, &opts);
+        opts.limit = &limit;
+    }
+
+    ret = run_copy(argc, argv, &opts);
+
+    if (opts.limit != NULL)
+        pthread_mutex_destroy(&limit.lock);
+
+    if (opts.report_stats)
+        print_stats(&opts, now_ns() - start);
+    return ret;
+}
@@ -1,10 +1,18 @@
 #include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <thread>
 #include <unistd.h>
 #include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
 extern "C" int cp_main(int argc, char *argv[]);
@@ -12,11 +20,13 @@ extern "C" int cp_main(int argc, char *argv[]);
 class CpTest : public ::testing::Test {
 protected:
     void SetUp() override {
-        // Any setup can be done here if needed
+        // Keep the user's calibration out of the tests: no file, built-in table
+        remove("tests_tuning.txt");
+        setenv("CP_TUNING_FILE", "tests_tuning.txt", 1);
     }
 
     void TearDown() override {
-        // Any cleanup can be done here if needed
+        remove("tests_tuning.txt");
     }
 
     void create_file(const char *filename, const char *content) {
@@ -41,6 +51,78 @@ protected:
         return content;
     }
 
+    void create_binary_file(const char *filename, const std::string &content) {
+        FILE *fp = fopen(filename, "wb");
+        ASSERT_NE(fp, nullptr) << "Failed to create file: " << filename;
+        fwrite(content.data(), 1, content.size(), fp);
+        fclose(fp);
+    }
+
+    std::string read_binary_file(const char *filename) {
+        FILE *fp = fopen(filename, "rb");
+        if (fp == nullptr) {
+            ADD_FAILURE() << "Failed to open file: " << filename;
+            return "";
+        }
+        char buffer[4096];
+        std::string content;
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+            content.append(buffer, n);
+        }
+        fclose(fp);
+        return content;
+    }
+
+    // Fraction of the pages of filename that are in the page cache
+    double resident_fraction(const char *filename) {
+        int fd = open(filename, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+            ADD_FAILURE() << "Failed to open file: " << filename;
+            if (fd >= 0)
+                close(fd);
+            return 0;
+        }
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            ADD_FAILURE() << "Failed to map file: " << filename;
+            return 0;
+        }
+        long page = sysconf(_SC_PAGESIZE);
+        size_t pages = (st.st_size + page - 1) / page;
+        std::vector<unsigned char> vec(pages);
+        size_t resident = 0;
+        if (mincore(map, st.st_size, vec.data()) == 0) {
+            for (unsigned char v : vec)
+                resident += v & 1;
+        }
+        munmap(map, st.st_size);
+        return (double) resident / pages;
+    }
+
+    std::string random_content(size_t size) {
+        std::string content(size, '\0');
+        unsigned int seed = 12345;
+        for (size_t i = 0; i < size; i++) {
+            seed = seed * 1103515245 + 12345;
+            content[i] = (char) (seed >> 16);
+        }
+        return content;
+    }
+
+    // Old kernels, seccomp filters and kernel.io_uring_disabled refuse io_uring
+    bool io_uring_available() {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int fd = syscall(__NR_io_uring_setup, 1, &params);
+        if (fd < 0)
+            return false;
+        close(fd);
+        return true;
+    }
+
     std::pair<std::string, int> run_cp_command(int argc, char *argv[]) {
         int pipefd[2];
         pid_t pid;
@@ -53,6 +135,7 @@ protected:
             exit(EXIT_FAILURE);
         }
 
+        fflush(stdout); // Don't let the child flush our buffered output into the pipe
         pid = fork();
         if (pid == -1) {
             perror("fork");
@@ -69,7 +152,7 @@ protected:
             exit(cp_main(argc, argv));
         } else { // Parent process
             close(pipefd[1]); // Close unused write end
-            wait(&status); // Wait for child process to finish
+            waitpid(pid, &status, 0); // Wait for child process to finish
 
             ssize_t n;
             while ((n = read(pipefd[0], buffer, sizeof(buffer) - 1)) > 0) {
@@ -226,3 +309,1327 @@ TEST_F(CpTest, SmallerNewFile) {
     remove(source);
     remove(destination);
 }
+
+TEST_F(CpTest, CopyBinaryFile) {
+    const char *source = "binary_source.bin";
+    const char *destination = "binary_destination.bin";
+    std::string content = random_content(4 * 1024 * 1024 + 123); // Not a multiple of any chunk size
+
+    create_binary_file(source, content);
+
+    const char *argv[] = {"cp", source, destination, NULL};
+    int argc = 3;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    int status = result_status.second;
+
+    ASSERT_EQ(status, 0) << "cp program should return 0 on success.";
+
+    std::string dest_content = read_binary_file(destination);
+    ASSERT_EQ(content.size(), dest_content.size()) << "The destination file should have the same size as the source file.";
+    ASSERT_TRUE(content == dest_content) << "The content of the destination file should match the source file byte for byte.";
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, CopyProcFile) {
+    const char *source = "/proc/version";
+    const char *destination = "version_destination.txt";
+
+    const char *argv[] = {"cp", source, destination, NULL};
+    int argc = 3;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    int status = result_status.second;
+
+    ASSERT_EQ(status, 0) << "cp program should return 0 on success.";
+
+    // procfs files report a size of 0, the copy must fall back to read()
+    std::string dest_content = read_binary_file(destination);
+    ASSERT_FALSE(dest_content.empty()) << "Files without a known size should still be copied.";
+    ASSERT_EQ(read_binary_file(source), dest_content) << "The content of the destination file should match the source file.";
+
+    // Clean up
+    remove(destination);
+}
+
+TEST_F(CpTest, CopySparseFile) {
+    const char *source = "sparse_source.img";
+    const char *destination = "sparse_destination.img";
+    const off_t size = 64 * 1024 * 1024;
+    std::string data = random_content(1024 * 1024);
+
+    // 64 MiB file with 1 MiB of data at the start, in the middle and at the end
+    int fd = open(source, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(ftruncate(fd, size), 0);
+    ASSERT_EQ(pwrite(fd, data.data(), data.size(), 0), (ssize_t) data.size());
+    ASSERT_EQ(pwrite(fd, data.data(), data.size(), size / 2), (ssize_t) data.size());
+    ASSERT_EQ(pwrite(fd, data.data(), data.size(), size - data.size()), (ssize_t) data.size());
+    close(fd);
+
+    struct stat src_st;
+    ASSERT_EQ(stat(source, &src_st), 0);
+    if ((off_t) src_st.st_blocks * 512 >= size) {
+        remove(source);
+        GTEST_SKIP() << "The file system does not support sparse files.";
+    }
+
+    const char *argv[] = {"cp", "--sparse=always", source, destination, NULL};
+    int argc = 4;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    int status = result_status.second;
+
+    ASSERT_EQ(status, 0) << "cp program should return 0 on success.";
+
+    struct stat dest_st;
+    ASSERT_EQ(stat(destination, &dest_st), 0);
+    ASSERT_EQ(dest_st.st_size, size) << "The destination file should have the same size as the source file.";
+    ASSERT_LE(dest_st.st_blocks, src_st.st_blocks + 64) << "The holes of the source file should not be written to the destination file.";
+    ASSERT_TRUE(read_binary_file(source) == read_binary_file(destination)) << "The content of the destination file should match the source file.";
+
+    // The dense copy allocates every block
+    const char *argv2[] = {"cp", "--sparse=never", source, destination, NULL};
+
+    result_status = run_cp_command(argc, const_cast<char**>(argv2));
+    status = result_status.second;
+
+    ASSERT_EQ(status, 0) << "cp program should return 0 on success.";
+    ASSERT_EQ(stat(destination, &dest_st), 0);
+    ASSERT_GE((off_t) dest_st.st_blocks * 512, size) << "--sparse=never should write the holes out as zeros.";
+    ASSERT_TRUE(read_binary_file(source) == read_binary_file(destination)) << "The content of the destination file should match the source file.";
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, CopySparseFileToDevice) {
+    const char *source = "sparse_source.img";
+    std::string data = random_content(64 * 1024);
+
+    // 4 MiB file with data only at the start and at the end
+    int fd = open(source, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(ftruncate(fd, 4 * 1024 * 1024), 0);
+    ASSERT_EQ(pwrite(fd, data.data(), data.size(), 0), (ssize_t) data.size());
+    ASSERT_EQ(pwrite(fd, data.data(), data.size(), 4 * 1024 * 1024 - data.size()), (ssize_t) data.size());
+    close(fd);
+
+    // A device cannot seek over holes, so the copy is written out densely
+    const char *argv[] = {"cp", source, "/dev/null", NULL};
+    auto result_status = run_cp_command(3, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0) << "cp should copy a sparse file to /dev/null.";
+    ASSERT_EQ(result_status.first, "");
+
+    const char *argv_always[] = {"cp", "--sparse=always", source, "/dev/null", NULL};
+    result_status = run_cp_command(4, const_cast<char**>(argv_always));
+    ASSERT_EQ(result_status.second, 0) << "--sparse=always should not fail on a device.";
+
+    // Clean up
+    remove(source);
+}
+
+TEST_F(CpTest, InvalidSparseMode) {
+    const char *source = "source.txt";
+    const char *destination = "destination.txt";
+
+    create_file(source, "This is a test file.");
+
+    const char *argv[] = {"cp", "--sparse=sometimes", source, destination, NULL};
+    int argc = 4;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    int status = result_status.second;
+
+    ASSERT_NE(status, 0) << "cp program should reject an unknown --sparse mode.";
+    ASSERT_EQ(access(destination, F_OK), -1) << "The destination file should not be created on a usage error.";
+
+    // Clean up
+    remove(source);
+}
+
+TEST_F(CpTest, ReflinkFallback) {
+    const char *source = "source.txt";
+    const char *destination = "destination.txt";
+    const char *content = "This is a test file.";
+
+    create_file(source, content);
+
+    const char *argv[] = {"cp", "-v", "--reflink=auto", source, destination, NULL};
+    int argc = 5;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    std::string result = result_status.first;
+    int status = result_status.second;
+
+    ASSERT_EQ(status, 0) << "cp program should return 0 on success.";
+    ASSERT_STREQ(content, read_file(destination).c_str()) << "The content of the destination file should match the source file.";
+    ASSERT_NE(result.find("'source.txt' -> 'destination.txt' ("), std::string::npos) << "-v should report the copy method that was used.";
+
+    bool cloned = result.find("clone") != std::string::npos;
+
+    // --reflink=always must fail where cloning is not possible
+    const char *argv2[] = {"cp", "--reflink", source, destination, NULL};
+    int argc2 = 4;
+
+    result_status = run_cp_command(argc2, const_cast<char**>(argv2));
+    status = result_status.second;
+
+    if (cloned)
+        ASSERT_EQ(status, 0) << "--reflink=always should succeed on a copy-on-write file system.";
+    else
+        ASSERT_NE(status, 0) << "--reflink=always should fail if the file system cannot clone.";
+
+    // --reflink=never always copies
+    const char *argv3[] = {"cp", "-v", "--reflink=never", source, destination, NULL};
+
+    result_status = run_cp_command(argc, const_cast<char**>(argv3));
+    result = result_status.first;
+    status = result_status.second;
+
+    ASSERT_EQ(status, 0) << "cp program should return 0 on success.";
+    ASSERT_EQ(result.find("clone"), std::string::npos) << "--reflink=never should not clone.";
+    ASSERT_STREQ(content, read_file(destination).c_str()) << "The content of the destination file should match the source file.";
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, ReflinkOnLoopbackImage) {
+    const char *image = "reflink.img";
+    const char *mnt = "reflink_mnt";
+
+    // Needs root and a copy-on-write file system we can format
+    if (geteuid() != 0 ||
+        (system("command -v mkfs.btrfs >/dev/null 2>&1") != 0 &&
+         system("command -v mkfs.xfs >/dev/null 2>&1") != 0)) {
+        GTEST_SKIP() << "Needs root and mkfs.btrfs or mkfs.xfs.";
+    }
+
+    int fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(ftruncate(fd, 512 * 1024 * 1024), 0);
+    close(fd);
+    mkdir(mnt, 0755);
+
+    if (system("(mkfs.btrfs -q reflink.img || mkfs.xfs -q -m reflink=1 reflink.img) >/dev/null 2>&1") != 0 ||
+        system("mount -o loop reflink.img reflink_mnt >/dev/null 2>&1") != 0) {
+        rmdir(mnt);
+        remove(image);
+        GTEST_SKIP() << "Loopback mount is not available.";
+    }
+
+    std::string content = random_content(8 * 1024 * 1024);
+    create_binary_file("reflink_mnt/source.bin", content);
+
+    const char *argv[] = {"cp", "-v", "--reflink=always", "reflink_mnt/source.bin", "reflink_mnt/destination.bin", NULL};
+    int argc = 5;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    std::string result = result_status.first;
+    int status = result_status.second;
+
+    EXPECT_EQ(status, 0) << "cp program should clone on a copy-on-write file system.";
+    EXPECT_NE(result.find("(clone)"), std::string::npos) << "-v should report the clone.";
+    EXPECT_TRUE(content == read_binary_file("reflink_mnt/destination.bin")) << "The content of the clone should match the source file.";
+
+    // Clean up
+    system("umount reflink_mnt");
+    rmdir(mnt);
+    remove(image);
+}
+
+TEST_F(CpTest, DirectCopy) {
+    const char *source = "direct_source.bin";
+    const char *destination = "direct_destination.bin";
+    std::string content = random_content(16 * 1024 * 1024 + 123); // Unaligned tail
+
+    create_binary_file(source, content);
+
+    const char *argv[] = {"cp", "-v", "--direct", source, destination, NULL};
+    int argc = 5;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    std::string result = result_status.first;
+    int status = result_status.second;
+
+    ASSERT_EQ(status, 0) << "cp program should return 0 on success.";
+
+    struct stat st;
+    ASSERT_EQ(stat(destination, &st), 0);
+    ASSERT_EQ(st.st_size, (off_t) content.size()) << "The padded tail should be cut off the destination file.";
+
+    // Where O_DIRECT works the copy must not fill the page cache
+    if (result.find("direct") != std::string::npos) {
+        ASSERT_LT(resident_fraction(destination), 0.1) << "A direct copy should leave the destination out of the page cache.";
+    }
+
+    ASSERT_TRUE(content == read_binary_file(destination)) << "The content of the destination file should match the source file.";
+
+    // A pipe cannot be written at an offset, so it gets a normal copy
+    const char *text = "direct to a pipe\n";
+    create_file(source, text);
+    const char *argv_pipe[] = {"cp", "--direct", source, "-", NULL};
+    result_status = run_cp_command(4, const_cast<char**>(argv_pipe));
+    ASSERT_EQ(result_status.second, 0) << "cp --direct should fall back for a pipe.";
+    ASSERT_EQ(result_status.first, text);
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, CopyStrategies) {
+    const char *source = "strategy_source.bin";
+    const char *destination = "strategy_destination.bin";
+    std::string content = random_content(3 * 1024 * 1024 + 4097);
+    const char *strategies[] = {"copy_file_range", "sendfile", "read_write", "mmap", "io_uring", "threads", "stream", "pipeline"};
+    const char *methods[] = {"copy_file_range", "sendfile", "read/write", "mmap", "io_uring", "threads", "stream", "pipeline"};
+
+    create_binary_file(source, content);
+
+    for (size_t i = 0; i < sizeof(strategies) / sizeof(strategies[0]); i++) {
+        std::string option = std::string("--strategy=") + strategies[i];
+        const char *argv[] = {"cp", "-v", "--reflink=never", option.c_str(), source, destination, NULL};
+        int argc = 6;
+
+        auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+        std::string result = result_status.first;
+        int status = result_status.second;
+
+        ASSERT_EQ(status, 0) << "cp program should return 0 on success with " << option;
+        // Without io_uring the copy falls back, which the content check still covers
+        if (strcmp(strategies[i], "io_uring") != 0 || io_uring_available())
+            ASSERT_NE(result.find(methods[i]), std::string::npos) << option << " should copy with " << methods[i];
+        ASSERT_TRUE(content == read_binary_file(destination)) << "The content of the destination file should match the source file with " << option;
+    }
+
+    const char *argv[] = {"cp", "--strategy=teleport", source, destination, NULL};
+    int argc = 4;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    ASSERT_NE(result_status.second, 0) << "cp program should reject an unknown strategy.";
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, RecursiveCopy) {
+    const char *source = "tree_source";
+    const char *destination = "tree_destination";
+    char path[256];
+
+    // 4 directories with 2 levels of 50 files each, plus a symlink
+    system("rm -rf tree_source tree_destination");
+    ASSERT_EQ(mkdir(source, 0755), 0);
+    for (int d = 0; d < 4; d++) {
+        snprintf(path, sizeof(path), "%s/dir%d", source, d);
+        ASSERT_EQ(mkdir(path, 0755), 0);
+        snprintf(path, sizeof(path), "%s/dir%d/sub", source, d);
+        ASSERT_EQ(mkdir(path, 0755), 0);
+        for (int f = 0; f < 50; f++) {
+            snprintf(path, sizeof(path), "%s/dir%d/file%d.txt", source, d, f);
+            create_file(path, path);
+            snprintf(path, sizeof(path), "%s/dir%d/sub/file%d.txt", source, d, f);
+            create_file(path, path);
+        }
+    }
+    ASSERT_EQ(symlink("dir0/file0.txt", "tree_source/link"), 0);
+
+    const char *argv[] = {"cp", "-r", "-j", "4", source, destination, NULL};
+    int argc = 6;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    int status = result_status.second;
+
+    ASSERT_EQ(status, 0) << "cp -r should return 0 on success.";
+
+    for (int d = 0; d < 4; d++) {
+        for (int f = 0; f < 50; f++) {
+            char dest_path[256];
+            snprintf(path, sizeof(path), "%s/dir%d/sub/file%d.txt", source, d, f);
+            snprintf(dest_path, sizeof(dest_path), "%s/dir%d/sub/file%d.txt", destination, d, f);
+            ASSERT_STREQ(path, read_file(dest_path).c_str()) << "Every file of the tree should be copied.";
+        }
+    }
+
+    char target[256] = {0};
+    ASSERT_GT(readlink("tree_destination/link", target, sizeof(target) - 1), 0) << "Symbolic links should be recreated.";
+    ASSERT_STREQ("dir0/file0.txt", target);
+
+    // An existing destination directory receives a copy named after the source
+    result_status = run_cp_command(argc, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0) << "cp -r should return 0 on success.";
+    ASSERT_STREQ("tree_source/dir3/file49.txt", read_file("tree_destination/tree_source/dir3/file49.txt").c_str()) << "The tree should be copied into the existing directory.";
+
+    // Clean up
+    system("rm -rf tree_source tree_destination");
+}
+
+TEST_F(CpTest, PreserveHardLinks) {
+    struct stat st_a, st_b, st_c, st_d;
+    std::string content(1 << 20, 'h');
+
+    // a, b and sub/c are the same file, d is a separate one
+    system("rm -rf links_source links_destination");
+    ASSERT_EQ(mkdir("links_source", 0755), 0);
+    ASSERT_EQ(mkdir("links_source/sub", 0755), 0);
+    create_file("links_source/a", content.c_str());
+    ASSERT_EQ(link("links_source/a", "links_source/b"), 0);
+    ASSERT_EQ(link("links_source/a", "links_source/sub/c"), 0);
+    create_file("links_source/d", "separate");
+
+    const char *argv[] = {"cp", "-r", "-v", "-j", "4", "links_source", "links_destination", NULL};
+    int argc = 7;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0) << "cp -r should return 0 on success.";
+    ASSERT_NE(result_status.first.find("(hard link)"), std::string::npos) << result_status.first;
+
+    ASSERT_EQ(stat("links_destination/a", &st_a), 0);
+    ASSERT_EQ(stat("links_destination/b", &st_b), 0);
+    ASSERT_EQ(stat("links_destination/sub/c", &st_c), 0);
+    ASSERT_EQ(stat("links_destination/d", &st_d), 0);
+    ASSERT_EQ(st_a.st_ino, st_b.st_ino) << "Hard links should be recreated, not copied.";
+    ASSERT_EQ(st_a.st_ino, st_c.st_ino) << "Hard links should be recreated, not copied.";
+    ASSERT_NE(st_a.st_ino, st_d.st_ino);
+    ASSERT_EQ(st_a.st_nlink, 3u);
+    ASSERT_EQ(st_d.st_nlink, 1u);
+    ASSERT_STREQ(content.c_str(), read_file("links_destination/sub/c").c_str());
+    ASSERT_STREQ("separate", read_file("links_destination/d").c_str());
+
+    // Copying into the existing directory links the new copy, not the old one
+    result_status = run_cp_command(argc, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0) << "cp -r should return 0 on success.";
+    ASSERT_EQ(stat("links_destination/links_source/b", &st_b), 0);
+    ASSERT_EQ(stat("links_destination/links_source/a", &st_c), 0);
+    ASSERT_EQ(st_b.st_ino, st_c.st_ino);
+    ASSERT_NE(st_b.st_ino, st_a.st_ino);
+
+    // Clean up
+    system("rm -rf links_source links_destination");
+}
+
+TEST_F(CpTest, RecursiveCopyOfReadOnlyTree) {
+    struct stat st_a, st_b;
+
+    // Read-only directories, one with hard links that are made last
+    system("chmod -R u+w ro_source ro_destination 2>/dev/null; rm -rf ro_source ro_destination");
+    ASSERT_EQ(mkdir("ro_source", 0755), 0);
+    ASSERT_EQ(mkdir("ro_source/sub", 0755), 0);
+    create_file("ro_source/sub/a", "read-only");
+    ASSERT_EQ(link("ro_source/sub/a", "ro_source/sub/b"), 0);
+    ASSERT_EQ(chmod("ro_source/sub", 0500), 0);
+    ASSERT_EQ(chmod("ro_source", 0555), 0);
+
+    const char *argv[] = {"cp", "-r", "ro_source", "ro_destination", NULL};
+    auto result_status = run_cp_command(4, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0) << "cp -r should copy read-only directories.";
+    ASSERT_STREQ("read-only", read_file("ro_destination/sub/a").c_str());
+    ASSERT_EQ(stat("ro_destination/sub/a", &st_a), 0);
+    ASSERT_EQ(stat("ro_destination/sub/b", &st_b), 0);
+    ASSERT_EQ(st_a.st_ino, st_b.st_ino);
+
+    // The directories get the source mode back once they are filled
+    ASSERT_EQ(stat("ro_destination", &st_a), 0);
+    ASSERT_EQ(st_a.st_mode & 07777, 0555u);
+    ASSERT_EQ(stat("ro_destination/sub", &st_a), 0);
+    ASSERT_EQ(st_a.st_mode & 07777, 0500u);
+
+    // Clean up
+    system("chmod -R u+w ro_source ro_destination; rm -rf ro_source ro_destination");
+}
+
+TEST_F(CpTest, RecursiveCopyIntoItself) {
+    system("rm -rf self_tree");
+    ASSERT_EQ(mkdir("self_tree", 0755), 0);
+    ASSERT_EQ(mkdir("self_tree/sub", 0755), 0);
+    create_file("self_tree/file.txt", "content");
+
+    const char *argv[] = {"cp", "-r", "self_tree", "self_tree/sub", NULL};
+    int argc = 4;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+
+    // Must terminate with an error, and not copy the new directory into itself again
+    ASSERT_NE(result_status.second, 0) << "Copying a directory into itself should fail.";
+    ASSERT_NE(result_status.first.find("into itself"), std::string::npos) << result_status.first;
+    ASSERT_STREQ("content", read_file("self_tree/sub/self_tree/file.txt").c_str());
+    ASSERT_EQ(access("self_tree/sub/self_tree/sub/self_tree", F_OK), -1) << "The copy should not descend into the destination.";
+
+    // Clean up
+    system("rm -rf self_tree");
+}
+
+TEST_F(CpTest, DirectoryWithoutRecursive) {
+    system("rm -rf plain_dir copied_dir");
+    ASSERT_EQ(mkdir("plain_dir", 0755), 0);
+
+    const char *argv[] = {"cp", "plain_dir", "copied_dir", NULL};
+    int argc = 3;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+
+    ASSERT_NE(result_status.second, 0) << "cp should refuse to copy a directory without -r.";
+    ASSERT_EQ(access("copied_dir", F_OK), -1) << "Nothing should be created without -r.";
+
+    // Clean up
+    rmdir("plain_dir");
+}
+
+TEST_F(CpTest, IoUringQueueDepths) {
+    const char *source = "uring_source.bin";
+    const char *destination = "uring_destination.bin";
+    std::string content = random_content(5 * 1024 * 1024 + 17); // Many chunks and a short tail
+
+    create_binary_file(source, content);
+
+    for (const char *depth : {"1", "3", "64"}) {
+        std::string option = std::string("--queue-depth=") + depth;
+        const char *argv[] = {"cp", "--reflink=never", "--strategy=io_uring", option.c_str(), source, destination, NULL};
+        int argc = 6;
+
+        auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+
+        ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success with " << option;
+        ASSERT_TRUE(content == read_binary_file(destination)) << "The content of the destination file should match the source file with " << option;
+    }
+
+    const char *argv[] = {"cp", "--queue-depth=0", source, destination, NULL};
+    int argc = 4;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    ASSERT_NE(result_status.second, 0) << "cp program should reject a queue depth of 0.";
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, ThreadedChunkCopy) {
+    const char *source = "chunked_source.bin";
+    const char *destination = "chunked_destination.bin";
+    std::string content = random_content(45 * 1024 * 1024 + 4321); // Several chunks and a short tail
+    const char *existing_content = "This is the initial content of the destination file.";
+
+    create_binary_file(source, content);
+
+    for (const char *jobs : {"1", "4", "16"}) {
+        create_file(destination, existing_content);
+
+        const char *argv[] = {"cp", "-v", "--reflink=never", "--strategy=threads", "-j", jobs, source, destination, NULL};
+        int argc = 8;
+
+        auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+
+        ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success with -j " << jobs;
+        ASSERT_NE(result_status.first.find("threads"), std::string::npos) << "The copy should use the threads strategy.";
+
+        std::string dest_content = read_binary_file(destination);
+        ASSERT_EQ(content.size(), dest_content.size()) << "The destination file should have the same size as the source file with -j " << jobs;
+        ASSERT_TRUE(content == dest_content) << "The content of the destination file should match the source file byte for byte with -j " << jobs;
+    }
+
+    // A device cannot be sized up front, so it gets a normal copy
+    const char *argv_null[] = {"cp", "--strategy=threads", "-j", "4", source, "/dev/null", NULL};
+    auto result_status = run_cp_command(6, const_cast<char**>(argv_null));
+    ASSERT_EQ(result_status.second, 0) << "--strategy=threads should fall back for /dev/null.";
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, StreamCopyLeavesCacheAlone) {
+    const char *source = "stream_source.bin";
+    const char *destination = "stream_destination.bin";
+    std::string content = random_content(48 * 1024 * 1024 + 99);
+
+    create_binary_file(source, content);
+
+    // Dirty pages can't be dropped, write the source back first
+    int fd = open(source, O_RDONLY);
+    ASSERT_GE(fd, 0);
+    fsync(fd);
+    close(fd);
+
+    const char *argv[] = {"cp", "--reflink=never", "--strategy=stream", source, destination, NULL};
+    int argc = 5;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+
+    ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+
+    // Only about the last window may still be cached
+    EXPECT_LT(resident_fraction(source), 0.5) << "A stream copy should drop the source from the page cache.";
+    EXPECT_LT(resident_fraction(destination), 0.5) << "A stream copy should drop the destination from the page cache.";
+
+    ASSERT_TRUE(content == read_binary_file(destination)) << "The content of the destination file should match the source file.";
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, PreallocatedCopy) {
+    const char *source = "prealloc_source.bin";
+    const char *destination = "prealloc_destination.bin";
+    std::string content = random_content(20 * 1024 * 1024 + 5);
+    const char *strategies[] = {"--strategy=read_write", "--strategy=direct", "--strategy=mmap"};
+
+    create_binary_file(source, content);
+
+    for (const char *strategy : strategies) {
+        const char *argv[] = {"cp", "--reflink=never", strategy, source, destination, NULL};
+        int argc = 5;
+
+        auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+
+        ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success with " << strategy;
+
+        struct stat st;
+        ASSERT_EQ(stat(destination, &st), 0);
+        ASSERT_EQ(st.st_size, (off_t) content.size()) << "Preallocation must not change the size of the destination with " << strategy;
+        ASSERT_GE((off_t) st.st_blocks * 512, st.st_size) << "The destination should be fully allocated with " << strategy;
+        ASSERT_TRUE(content == read_binary_file(destination)) << "The content of the destination file should match the source file with " << strategy;
+    }
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, ChecksumCopy) {
+    const char *source = "checksum_source.txt";
+    const char *destination = "checksum_destination.txt";
+
+    create_file(source, "123456789");
+
+    const char *argv[] = {"cp", "--checksum", "--verify", source, destination, NULL};
+    int argc = 5;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+
+    ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+    ASSERT_EQ(result_status.first, "e3069283  checksum_destination.txt\n") << "--checksum should print the CRC32C of the data.";
+    ASSERT_STREQ("123456789", read_file(destination).c_str()) << "The content of the destination file should match the source file.";
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, ChecksumDetectsCorruption) {
+    const char *source = "corrupt_source.bin";
+    const char *destination = "corrupt_destination.bin";
+    std::string content = random_content(3 * 1024 * 1024 + 1);
+
+    create_binary_file(source, content);
+
+    const char *argv[] = {"cp", "--checksum", "--verify", source, destination, NULL};
+    int argc = 5;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+
+    ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+    std::string digest = result_status.first.substr(0, 8);
+
+    // The digest of the good data is accepted
+    std::string expect = "--expect=" + digest;
+    const char *argv2[] = {"cp", expect.c_str(), source, destination, NULL};
+    int argc2 = 4;
+
+    result_status = run_cp_command(argc2, const_cast<char**>(argv2));
+    ASSERT_EQ(result_status.second, 0) << "--expect should accept the right checksum.";
+
+    // Flip a single bit in the middle of the source
+    int fd = open(source, O_RDWR);
+    ASSERT_GE(fd, 0);
+    char byte = content[content.size() / 2] ^ 0x10;
+    ASSERT_EQ(pwrite(fd, &byte, 1, content.size() / 2), 1);
+    close(fd);
+
+    const char *argv3[] = {"cp", "-v", expect.c_str(), source, destination, NULL};
+    result_status = run_cp_command(5, const_cast<char**>(argv3));
+    ASSERT_NE(result_status.second, 0) << "cp program should fail when the data does not match the expected checksum.";
+    ASSERT_NE(result_status.first.find("checksum mismatch"), std::string::npos) << "The mismatch should be reported.";
+    ASSERT_EQ(result_status.first.find("->"), std::string::npos) << "A failed copy should not be reported as done.";
+
+    // --verify reads the destination back: flip a bit of what was already
+    // written while a slowed down copy is still going
+    remove(destination);
+    std::thread corrupter([&]() {
+        struct stat st;
+        for (int i = 0; i < 5000; i++) {
+            if (stat(destination, &st) == 0 && st.st_size >= 1024 * 1024)
+                break;
+            usleep(1000);
+        }
+        int fd = open(destination, O_WRONLY);
+        char byte = content[0] ^ 0x01;
+        if (fd >= 0) {
+            pwrite(fd, &byte, 1, 0);
+            close(fd);
+        }
+    });
+    const char *argv4[] = {"cp", "--verify", "--bwlimit=8M", source, destination, NULL};
+    result_status = run_cp_command(5, const_cast<char**>(argv4));
+    corrupter.join();
+    ASSERT_NE(result_status.second, 0) << "--verify should catch a corrupted destination.";
+    ASSERT_NE(result_status.first.find("verification of"), std::string::npos) << result_status.first;
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, IncrementalCopy) {
+    const char *source = "incremental_source.bin";
+    const char *destination = "incremental_destination.bin";
+    std::string content = random_content(16 * 1024 * 1024);
+
+    create_binary_file(source, content);
+
+    const char *argv[] = {"cp", source, destination, NULL};
+    int argc = 3;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+
+    // Change a few bytes in two places, both inside one 64 KiB block each
+    content[100] ^= 0x01;
+    content[10 * 1024 * 1024 + 7] ^= 0x80;
+    create_binary_file(source, content);
+
+    const char *argv2[] = {"cp", "--incremental", "-v", source, destination, NULL};
+    int argc2 = 5;
+
+    result_status = run_cp_command(argc2, const_cast<char**>(argv2));
+    ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+    ASSERT_NE(result_status.first.find("delta: 131072 bytes rewritten"), std::string::npos)
+        << "Only the two changed blocks should be rewritten: " << result_status.first;
+    ASSERT_EQ(read_binary_file(destination), content) << "The destination should match the source.";
+
+    // An unchanged source rewrites nothing
+    result_status = run_cp_command(argc2, const_cast<char**>(argv2));
+    ASSERT_EQ(result_status.second, 0);
+    ASSERT_NE(result_status.first.find("delta: 0 bytes rewritten"), std::string::npos) << result_status.first;
+
+    // A longer source is appended, a shorter one cuts the destination
+    content += random_content(1000);
+    create_binary_file(source, content);
+    result_status = run_cp_command(argc2, const_cast<char**>(argv2));
+    ASSERT_EQ(result_status.second, 0);
+    ASSERT_EQ(read_binary_file(destination), content) << "A grown source should be appended.";
+
+    content.resize(5 * 1024 * 1024 + 3);
+    create_binary_file(source, content);
+    result_status = run_cp_command(argc2, const_cast<char**>(argv2));
+    ASSERT_EQ(result_status.second, 0);
+    ASSERT_EQ(read_binary_file(destination), content) << "A shrunk source should truncate the destination.";
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, ResumeAfterKill) {
+    const char *source = "resume_source.bin";
+    const char *destination = "resume_destination.bin";
+    const char *journal = "resume_destination.bin.cp-journal";
+    std::string content = random_content(100 * 1024 * 1024);
+
+    create_binary_file(source, content);
+
+    const char *argv[] = {"cp", "--resume", "-v", source, destination, NULL};
+    int argc = 5;
+
+    // Kill the copy part way: SIGXFSZ ends it once the destination reaches
+    // 80 MiB, after the checkpoint at 64 MiB
+    auto interrupted_copy = [&]() {
+        pid_t pid = fork();
+        ASSERT_GE(pid, 0);
+        if (pid == 0) {
+            struct rlimit limit = {80 << 20, 80 << 20};
+            struct rlimit no_core = {0, 0};
+            setrlimit(RLIMIT_CORE, &no_core);
+            setrlimit(RLIMIT_FSIZE, &limit);
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, STDOUT_FILENO);
+            exit(cp_main(argc, const_cast<char**>(argv)));
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        ASSERT_TRUE(WIFSIGNALED(status) && WTERMSIG(status) == SIGXFSZ) << "The copy should have been killed.";
+        ASSERT_EQ(access(journal, F_OK), 0) << "The journal should survive the kill.";
+    };
+
+    interrupted_copy();
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+    ASSERT_NE(result_status.first.find("resumed at 67108864"), std::string::npos)
+        << "The copy should continue from the checkpoint: " << result_status.first;
+    ASSERT_EQ(read_binary_file(destination), content) << "The resumed copy should match the source.";
+    ASSERT_NE(access(journal, F_OK), 0) << "The journal should be removed once the copy is done.";
+
+    // A destination that does not match the journal is copied from scratch
+    remove(destination);
+    interrupted_copy();
+
+    int fd = open(destination, O_RDWR);
+    ASSERT_GE(fd, 0);
+    char byte = content[1000] ^ 0x01;
+    ASSERT_EQ(pwrite(fd, &byte, 1, 1000), 1);
+    close(fd);
+
+    result_status = run_cp_command(argc, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+    ASSERT_EQ(result_status.first.find("resumed at"), std::string::npos)
+        << "A corrupt prefix must not be trusted: " << result_status.first;
+    ASSERT_EQ(read_binary_file(destination), content) << "The copy should match the source.";
+
+    // A pipe cannot be resumed, so it replaces the whole destination
+    int pipefd[2];
+    ASSERT_EQ(pipe(pipefd), 0);
+    ASSERT_EQ(write(pipefd[1], "short", 5), 5);
+    close(pipefd[1]);
+    fflush(stdout);
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+        dup2(pipefd[0], STDIN_FILENO);
+        const char *argv_pipe[] = {"cp", "--resume", "-", destination, NULL};
+        _exit(cp_main(4, const_cast<char**>(argv_pipe)));
+    }
+    close(pipefd[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0) << "cp --resume - should read stdin.";
+    ASSERT_TRUE(read_binary_file(destination) == "short") << "The old tail of the destination should be gone.";
+    ASSERT_NE(access(journal, F_OK), 0) << "The journal should be removed once the copy is done.";
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, CopyManyFilesIntoDirectory) {
+    const char *directory = "many_files_dir";
+    const char *sources[] = {"many_a.conf", "many_b.conf", "many_c.bin"};
+    std::string big = random_content(200 * 1024);
+
+    mkdir(directory, 0755);
+    create_file(sources[0], "alpha\n");
+    create_file(sources[1], "beta\n");
+    create_binary_file(sources[2], big);
+
+    const char *argv[] = {"cp", "-v", sources[0], sources[1], sources[2], "many_files_dir/", NULL};
+    int argc = 6;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+    ASSERT_EQ(read_file("many_files_dir/many_a.conf"), "alpha\n");
+    ASSERT_EQ(read_file("many_files_dir/many_b.conf"), "beta\n");
+    ASSERT_EQ(read_binary_file("many_files_dir/many_c.bin"), big);
+
+    // Small files are copied with a single read() and write()
+    ASSERT_NE(result_status.first.find("'many_a.conf' -> 'many_files_dir/many_a.conf' (read/write)"),
+              std::string::npos) << result_status.first;
+
+    // A single file onto a directory also lands inside it
+    create_file(sources[0], "gamma\n");
+    const char *argv2[] = {"cp", sources[0], directory, NULL};
+    int argc2 = 3;
+
+    result_status = run_cp_command(argc2, const_cast<char**>(argv2));
+    ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+    ASSERT_EQ(read_file("many_files_dir/many_a.conf"), "gamma\n");
+
+    // Several sources need a directory to go to
+    const char *argv3[] = {"cp", sources[0], sources[1], sources[2], NULL};
+    int argc3 = 4;
+
+    result_status = run_cp_command(argc3, const_cast<char**>(argv3));
+    ASSERT_NE(result_status.second, 0) << "cp should fail when the last operand is not a directory.";
+    ASSERT_EQ(read_binary_file(sources[2]), big) << "The last operand must not be overwritten.";
+
+    // Clean up
+    for (const char *source : sources) {
+        remove(source);
+        remove((std::string(directory) + "/" + source).c_str());
+    }
+    rmdir(directory);
+}
+
+TEST_F(CpTest, CopyStats) {
+    const char *source = "stats_source.bin";
+    const char *destination = "stats_destination.bin";
+    const char *stats = "stats.json";
+    std::string content = random_content(1024 * 1024);
+
+    create_binary_file(source, content);
+
+    const char *argv[] = {"cp", "--stats=stats.json", "--strategy=read_write", "--buffer-size=4K",
+                          source, destination, NULL};
+    int argc = 6;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+    ASSERT_EQ(read_binary_file(destination), content);
+
+    // 256 full reads and one more that finds EOF, and 256 writes
+    std::string json = read_file(stats);
+    ASSERT_EQ(json.compare(0, 15, "{\"tool\": \"cp\", "), 0) << json;
+    ASSERT_NE(json.find("\"strategy\": \"read_write\", \"methods\": [\"read/write\"]"), std::string::npos) << json;
+    ASSERT_NE(json.find("\"files\": 1, \"bytes\": 1048576,"), std::string::npos) << json;
+    ASSERT_NE(json.find("\"read\": {\"calls\": 257, \"short\": 0, \"bytes\": 1048576,"), std::string::npos) << json;
+    ASSERT_NE(json.find("\"write\": {\"calls\": 256, \"short\": 0, \"bytes\": 1048576,"), std::string::npos) << json;
+    ASSERT_EQ(json.back(), '\n');
+
+    // Without a file name the stats go to stderr
+    const char *argv2[] = {"cp", "--stats", source, destination, NULL};
+    int argc2 = 4;
+
+    result_status = run_cp_command(argc2, const_cast<char**>(argv2));
+    ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+    ASSERT_NE(result_status.first.find("{\"tool\": \"cp\", \"strategy\": \"auto\""), std::string::npos)
+        << result_status.first;
+
+    // Clean up
+    remove(source);
+    remove(destination);
+    remove(stats);
+}
+
+TEST_F(CpTest, SpliceFromFifoAndStdio) {
+    const char *fifo = "splice_fifo";
+    const char *destination = "splice_destination.bin";
+    std::string content = random_content(5 * 1024 * 1024 + 17);
+
+    // A producer writes into a FIFO that cp drains to disk
+    ASSERT_EQ(mkfifo(fifo, 0644), 0);
+    fflush(stdout);
+    pid_t producer = fork();
+    ASSERT_GE(producer, 0);
+    if (producer == 0) {
+        int fd = open(fifo, O_WRONLY);
+        for (size_t done = 0; fd >= 0 && done < content.size(); ) {
+            ssize_t n = write(fd, content.data() + done, std::min<size_t>(65536, content.size() - done));
+            if (n <= 0)
+                _exit(1);
+            done += n;
+        }
+        _exit(0);
+    }
+
+    const char *argv[] = {"cp", "-v", fifo, destination, NULL};
+    int argc = 4;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    waitpid(producer, NULL, 0);
+    ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+    ASSERT_NE(result_status.first.find("(splice)"), std::string::npos) << result_status.first;
+    ASSERT_EQ(read_binary_file(destination), content) << "The FIFO data should be copied in full.";
+
+    // - reads stdin, here a pipe fed by another process
+    remove(destination);
+    fflush(stdout);
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+        int pipefd[2];
+        if (pipe(pipefd) < 0)
+            _exit(1);
+        if (fork() == 0) {
+            close(pipefd[0]);
+            for (size_t done = 0; done < content.size(); ) {
+                ssize_t n = write(pipefd[1], content.data() + done, content.size() - done);
+                if (n <= 0)
+                    _exit(1);
+                done += n;
+            }
+            _exit(0);
+        }
+        close(pipefd[1]);
+        dup2(pipefd[0], STDIN_FILENO);
+        const char *argv2[] = {"cp", "-", destination, NULL};
+        _exit(cp_main(3, const_cast<char**>(argv2)));
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0) << "cp - should read stdin.";
+    ASSERT_EQ(read_binary_file(destination), content) << "The stdin data should be copied in full.";
+
+    // - writes stdout
+    const char *text = "to standard output\n";
+    create_file(destination, text);
+    const char *argv3[] = {"cp", destination, "-", NULL};
+    int argc3 = 3;
+
+    result_status = run_cp_command(argc3, const_cast<char**>(argv3));
+    ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+    ASSERT_EQ(result_status.first, text) << "The file should be written to stdout.";
+    ASSERT_EQ(access("-", F_OK), -1) << "No file named - should be created.";
+
+    // A sparse file written to stdout has its holes filled in with zeros.
+    // It is larger than the pipe, so read it while cp runs.
+    const char *sparse = "sparse_source.img";
+    int fd = open(sparse, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(ftruncate(fd, 1024 * 1024), 0);
+    ASSERT_EQ(pwrite(fd, content.data(), 4096, 512 * 1024), 4096);
+    close(fd);
+
+    int pipefd[2];
+    ASSERT_EQ(pipe(pipefd), 0);
+    fflush(stdout);
+    pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+        close(pipefd[0]);
+        dup2(pipefd[1], STDOUT_FILENO);
+        const char *argv4[] = {"cp", sparse, "-", NULL};
+        _exit(cp_main(3, const_cast<char**>(argv4)));
+    }
+    close(pipefd[1]);
+    std::string piped;
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(pipefd[0], buffer, sizeof(buffer))) > 0)
+        piped.append(buffer, n);
+    close(pipefd[0]);
+    waitpid(pid, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0) << "cp should copy a sparse file to stdout.";
+    ASSERT_TRUE(piped == read_binary_file(sparse)) << "stdout should get every byte of the sparse file.";
+
+    // Clean up
+    remove(fifo);
+    remove(destination);
+    remove(sparse);
+}
+
+TEST_F(CpTest, RateLimitedCopy) {
+    // tmpfs, so the disk is not what holds the copy back
+    if (access("/dev/shm", W_OK) != 0)
+        GTEST_SKIP() << "No tmpfs at /dev/shm";
+
+    const char *source = "/dev/shm/cp_rate_source.bin";
+    const char *destination = "/dev/shm/cp_rate_destination.bin";
+    const double size = 10 * 1024 * 1024, rate = 20 * 1024 * 1024;
+    std::string content = random_content(size);
+
+    create_binary_file(source, content);
+
+    for (const char *strategy : {"--strategy=auto", "--strategy=read_write"}) {
+        const char *argv[] = {"cp", "--bwlimit=20M", "--burst=64K", strategy, source, destination, NULL};
+        int argc = 6;
+
+        auto start = std::chrono::steady_clock::now();
+        auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+        ASSERT_EQ(read_binary_file(destination), content);
+
+        // Never faster than the cap (give or take the burst), and not much slower
+        double achieved = size / elapsed.count();
+        EXPECT_LE(achieved, rate * 1.05) << strategy;
+        EXPECT_GE(achieved, rate * 0.8) << strategy;
+    }
+
+    // 16 writes of 64 KiB at 40 per second, of which the first 4 are free
+    const char *argv2[] = {"cp", "--iops=40", "--strategy=read_write", "--buffer-size=64K",
+                           source, destination, NULL};
+    int argc2 = 6;
+    content.resize(1024 * 1024);
+    create_binary_file(source, content);
+
+    auto start = std::chrono::steady_clock::now();
+    auto result_status = run_cp_command(argc2, const_cast<char**>(argv2));
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+    ASSERT_EQ(read_binary_file(destination), content);
+    EXPECT_GE(elapsed.count(), 0.28);
+    EXPECT_LE(elapsed.count(), 0.6);
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, UpdateSkipsUnchanged) {
+    const char *source = "update_source.bin";
+    const char *destination = "update_destination.bin";
+    std::string content(1 << 20, 'u');
+    struct stat st_src, st_dest;
+
+    create_file(source, content.c_str());
+    remove(destination);
+
+    const char *argv[] = {"cp", "-u", "-v", source, destination, NULL};
+    int argc = 5;
+
+    // The first copy writes the data and takes the source times
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0) << "cp -u should return 0 on success.";
+    ASSERT_EQ(result_status.first.find("(up to date)"), std::string::npos) << result_status.first;
+    ASSERT_EQ(stat(source, &st_src), 0);
+    ASSERT_EQ(stat(destination, &st_dest), 0);
+    ASSERT_EQ(st_src.st_mtim.tv_sec, st_dest.st_mtim.tv_sec) << "The destination should get the source mtime.";
+    ASSERT_EQ(st_src.st_mtim.tv_nsec, st_dest.st_mtim.tv_nsec);
+
+    // The second one leaves it alone
+    result_status = run_cp_command(argc, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0);
+    ASSERT_NE(result_status.first.find("(up to date)"), std::string::npos) << result_status.first;
+
+    // Same size and mtime but different data: only the sampled check notices
+    int fd = open(destination, O_WRONLY);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(pwrite(fd, "X", 1, 0), 1);
+    struct timespec times[2] = {st_src.st_atim, st_src.st_mtim};
+    ASSERT_EQ(futimens(fd, times), 0);
+    close(fd);
+
+    result_status = run_cp_command(argc, const_cast<char**>(argv));
+    ASSERT_NE(result_status.first.find("(up to date)"), std::string::npos) << result_status.first;
+
+    const char *argv_sample[] = {"cp", "--update=sample", "-v", source, destination, NULL};
+    result_status = run_cp_command(argc, const_cast<char**>(argv_sample));
+    ASSERT_EQ(result_status.second, 0);
+    ASSERT_EQ(result_status.first.find("(up to date)"), std::string::npos) << result_status.first;
+    ASSERT_STREQ(content.c_str(), read_file(destination).c_str()) << "A mismatching sample should recopy the file.";
+
+    // A newer source is copied again
+    struct timespec later[2] = {{0, UTIME_NOW}, {st_src.st_mtim.tv_sec + 10, 0}};
+    ASSERT_EQ(utimensat(AT_FDCWD, source, later, 0), 0);
+    result_status = run_cp_command(argc, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.first.find("(up to date)"), std::string::npos) << result_status.first;
+    ASSERT_EQ(stat(destination, &st_dest), 0);
+    ASSERT_EQ(st_src.st_mtim.tv_sec + 10, st_dest.st_mtim.tv_sec);
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, FanOutCopy) {
+    const char *source = "fan_source.bin";
+    std::string content(5 << 20, 'f');
+    std::string slow;
+
+    for (size_t i = 0; i < content.size(); i += 4096)
+        content[i] = 'a' + (i / 4096) % 26;
+    create_file(source, content.c_str());
+    remove("fan_fifo");
+    ASSERT_EQ(mkfifo("fan_fifo", 0644), 0);
+
+    // A destination that drains slowly must not stall or corrupt the others
+    std::thread reader([&slow]() {
+        char buffer[64 << 10];
+        ssize_t n;
+        int fd = open("fan_fifo", O_RDONLY);
+
+        while (fd >= 0 && (n = read(fd, buffer, sizeof(buffer))) > 0) {
+            slow.append(buffer, n);
+            usleep(1000);
+        }
+        if (fd >= 0)
+            close(fd);
+    });
+
+    const char *argv[] = {"cp", "-v", "--stats=fan_stats.json", "--fan-out", source,
+                          "fan_1.bin", "fan_2.bin", "fan_fifo", "fan_3.bin", NULL};
+    int argc = 9;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    reader.join();
+
+    ASSERT_EQ(result_status.second, 0) << "cp --fan-out should return 0 on success.";
+    ASSERT_NE(result_status.first.find("'fan_source.bin' -> 'fan_3.bin' (fan-out)"), std::string::npos)
+        << result_status.first;
+    ASSERT_STREQ(content.c_str(), read_file("fan_1.bin").c_str());
+    ASSERT_STREQ(content.c_str(), read_file("fan_2.bin").c_str());
+    ASSERT_STREQ(content.c_str(), read_file("fan_3.bin").c_str());
+    ASSERT_TRUE(slow == content) << "The slow destination should get every byte.";
+
+    // The source is read once, each destination written once
+    std::string json = read_file("fan_stats.json");
+    ASSERT_NE(json.find("\"files\": 4, \"bytes\": 20971520,"), std::string::npos) << json;
+    ASSERT_NE(json.find("\"read\": {\"calls\": 6, \"short\": 0, \"bytes\": 5242880,"), std::string::npos) << json;
+
+    // One missing destination fails the command but not the others
+    const char *argv_bad[] = {"cp", "--fan-out", source, "fan_1.bin", "fan_missing/x", NULL};
+    remove("fan_1.bin");
+    result_status = run_cp_command(5, const_cast<char**>(argv_bad));
+    ASSERT_NE(result_status.second, 0);
+    ASSERT_STREQ(content.c_str(), read_file("fan_1.bin").c_str());
+
+    // The copies get the source mode, and - is stdout
+    const char *text = "fanned out to standard output\n";
+    struct stat st;
+    create_file(source, text);
+    ASSERT_EQ(chmod(source, 0640), 0);
+    remove("fan_1.bin");
+    const char *argv_out[] = {"cp", "--fan-out", source, "fan_1.bin", "-", NULL};
+    result_status = run_cp_command(5, const_cast<char**>(argv_out));
+    ASSERT_EQ(result_status.second, 0);
+    ASSERT_EQ(result_status.first, text) << "The source should be written to stdout.";
+    ASSERT_EQ(access("-", F_OK), -1) << "No file named - should be created.";
+    ASSERT_STREQ(text, read_file("fan_1.bin").c_str());
+    ASSERT_EQ(stat("fan_1.bin", &st), 0);
+    ASSERT_EQ(st.st_mode & 07777, 0640u);
+
+    // Clean up
+    system("rm -f fan_source.bin fan_1.bin fan_2.bin fan_3.bin fan_fifo fan_stats.json");
+}
+
+TEST_F(CpTest, AtomicPublish) {
+    const char *source = "atomic_source.bin";
+    const char *destination = "atomic_dir/atomic_destination.bin";
+    const size_t old_size = 1000, new_size = 64 << 20;
+    std::string content = random_content(new_size);
+    struct stat st_before, st_after;
+    std::atomic<bool> copying(true);
+    std::atomic<long> torn(0), polls(0);
+
+    system("rm -rf atomic_dir");
+    ASSERT_EQ(mkdir("atomic_dir", 0755), 0);
+    create_binary_file(source, content);
+    create_binary_file(destination, std::string(old_size, 'o'));
+    ASSERT_EQ(stat(destination, &st_before), 0);
+
+    // A reader polling the path must only see the old or the complete file
+    std::thread poller([&]() {
+        struct stat st;
+
+        while (copying) {
+            if (stat(destination, &st) != 0 ||
+                ((size_t) st.st_size != old_size && (size_t) st.st_size != new_size))
+                torn++;
+            polls++;
+        }
+    });
+
+    const char *argv[] = {"cp", "--atomic", "--sync", "--verify", "--strategy=read_write",
+                          source, destination, NULL};
+    int argc = 7;
+
+    auto result_status = run_cp_command(argc, const_cast<char**>(argv));
+    copying = false;
+    poller.join();
+
+    ASSERT_EQ(result_status.second, 0) << "cp --atomic should return 0 on success.";
+    ASSERT_EQ(read_binary_file(destination), content);
+    ASSERT_GT(polls, 0);
+    ASSERT_EQ(torn, 0) << "Readers saw a missing or partial destination.";
+    ASSERT_EQ(stat(destination, &st_after), 0);
+    ASSERT_NE(st_before.st_ino, st_after.st_ino) << "The destination should be a new file.";
+    ASSERT_EQ(st_after.st_nlink, 1u) << "No temporary name should be left linked.";
+
+    // Nothing but the destination is left in the directory
+    result_status = run_cp_command(argc, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0);
+    ASSERT_EQ(system("test $(ls -A atomic_dir | wc -l) -eq 1"), 0) << "Temporary files were left behind.";
+
+    // A failed copy leaves the old file alone
+    create_binary_file(destination, std::string(old_size, 'o'));
+    const char *argv_bad[] = {"cp", "--atomic", "--expect=00000000", source, destination, NULL};
+    result_status = run_cp_command(5, const_cast<char**>(argv_bad));
+    ASSERT_NE(result_status.second, 0);
+    ASSERT_EQ(read_binary_file(destination), std::string(old_size, 'o'));
+    ASSERT_EQ(system("test $(ls -A atomic_dir | wc -l) -eq 1"), 0) << "Temporary files were left behind.";
+
+    // Clean up
+    remove(source);
+    system("rm -rf atomic_dir");
+}
+
+TEST_F(CpTest, PipelineCopy) {
+    const char *source = "pipeline_source.bin";
+    const char *destination = "pipeline_destination.bin";
+    std::string content = random_content(12 * 1024 * 1024 + 333);
+
+    create_binary_file(source, content);
+
+    // A writer slower than the reader: the ring fills up and the reader waits
+    const char *argv[] = {"cp", "-v", "--strategy=pipeline", "--bwlimit=64M", source, destination, NULL};
+    auto result_status = run_cp_command(6, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0) << "cp program should return 0 on success.";
+    ASSERT_NE(result_status.first.find("(pipeline)"), std::string::npos) << result_status.first;
+    ASSERT_TRUE(content == read_binary_file(destination));
+
+    // A writer that fails must stop the reader instead of leaving it blocked
+    const char *argv_full[] = {"cp", "--strategy=pipeline", source, "/dev/full", NULL};
+    result_status = run_cp_command(4, const_cast<char**>(argv_full));
+    ASSERT_NE(result_status.second, 0) << "Writing to /dev/full should fail.";
+
+    // Clean up
+    remove(source);
+    remove(destination);
+}
+
+TEST_F(CpTest, StrategyTable) {
+    const char *source = "table_source.bin";
+    const char *destination = "table_destination.bin";
+    const char *tuning = "table_tuning.txt";
+    std::string content = random_content(2 * 1024 * 1024);
+    struct statfs sfs;
+    char row[128];
+
+    create_binary_file(source, content);
+    ASSERT_EQ(statfs(".", &sfs), 0);
+    remove(tuning);
+    setenv("CP_TUNING_FILE", tuning, 1);
+
+    // Without a calibrated row the built-in table decides
+    const char *argv[] = {"cp", "-v", "--reflink=never", source, destination, NULL};
+    auto result_status = run_cp_command(5, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0);
+    ASSERT_NE(result_status.first.find("[strategy auto, built-in]"), std::string::npos) << result_status.first;
+
+    // A calibrated row for this file system and size wins
+    snprintf(row, sizeof(row), "# comment\nnot a row\n%lx same medium read_write\n", (unsigned long) sfs.f_type);
+    create_file(tuning, row);
+    result_status = run_cp_command(5, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0);
+    ASSERT_NE(result_status.first.find("(read/write) [strategy read_write, calibrated]"), std::string::npos)
+        << result_status.first;
+    ASSERT_TRUE(content == read_binary_file(destination));
+
+    // An explicit strategy is left alone
+    const char *argv_mmap[] = {"cp", "-v", "--reflink=never", "--strategy=mmap", source, destination, NULL};
+    result_status = run_cp_command(6, const_cast<char**>(argv_mmap));
+    ASSERT_EQ(result_status.second, 0) << result_status.first;
+    ASSERT_EQ(result_status.first.find("[strategy"), std::string::npos) << result_status.first;
+
+    // Calibration replaces the rows of its key and keeps the others
+    snprintf(row, sizeof(row), "%lx same medium read_write\n1234 other large mmap\n", (unsigned long) sfs.f_type);
+    create_file(tuning, row);
+    const char *argv_calibrate[] = {"cp", "--calibrate", ".", ".", NULL};
+    result_status = run_cp_command(4, const_cast<char**>(argv_calibrate));
+    ASSERT_EQ(result_status.second, 0) << result_status.first;
+
+    std::string table = read_file(tuning);
+    snprintf(row, sizeof(row), "%lx same ", (unsigned long) sfs.f_type);
+    for (const char *size : {"small", "medium", "large"}) {
+        size_t at = table.find(std::string(row) + size);
+        ASSERT_NE(at, std::string::npos) << "No row for " << size << " files: " << table;
+        ASSERT_EQ(table.find(std::string(row) + size, at + 1), std::string::npos) << "Duplicate rows: " << table;
+    }
+    ASSERT_NE(table.find("1234 other large mmap\n"), std::string::npos) << table;
+    ASSERT_EQ(access(".cp-calibrate", F_OK), -1) << "Calibration files should be removed.";
+
+    // Clean up
+    remove(source);
+    remove(destination);
+    remove(tuning);
+}
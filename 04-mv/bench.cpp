@@ -0,0 +1,171 @@
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+extern "C" int mv_main(int argc, char *argv[]);
+
+static const char *original = "bench_original.bin";
+static const char *source = "bench_source.bin";
+static const char *destination = "bench_destination.bin";
+static const char *shm_destination = "/dev/shm/bench_destination.bin";
+
+// System calls made by mv.o, counted through the -Wl,--wrap=NAME link
+// options in the Makefile
+static std::atomic<long> syscalls(0);
+
+#define WRAP(ret, name, params, args)                   \
+    extern "C" ret __real_##name params;                \
+    extern "C" ret __wrap_##name params                 \
+    {                                                   \
+        syscalls.fetch_add(1, std::memory_order_relaxed); \
+        return __real_##name args;                      \
+    }
+
+WRAP(ssize_t, read, (int fd, void *buf, size_t n), (fd, buf, n))
+WRAP(ssize_t, write, (int fd, const void *buf, size_t n), (fd, buf, n))
+WRAP(ssize_t, pread, (int fd, void *buf, size_t n, off_t off), (fd, buf, n, off))
+WRAP(ssize_t, pwrite, (int fd, const void *buf, size_t n, off_t off), (fd, buf, n, off))
+WRAP(int, openat, (int dirfd, const char *path, int flags, mode_t mode), (dirfd, path, flags, mode))
+WRAP(int, close, (int fd), (fd))
+WRAP(int, stat, (const char *path, struct stat *st), (path, st))
+WRAP(int, lstat, (const char *path, struct stat *st), (path, st))
+WRAP(int, fstat, (int fd, struct stat *st), (fd, st))
+WRAP(int, fstatat, (int dirfd, const char *path, struct stat *st, int flags), (dirfd, path, st, flags))
+WRAP(void *, mmap, (void *addr, size_t n, int prot, int flags, int fd, off_t off),
+     (addr, n, prot, flags, fd, off))
+WRAP(int, munmap, (void *addr, size_t n), (addr, n))
+WRAP(int, rename, (const char *from, const char *to), (from, to))
+WRAP(int, unlinkat, (int dirfd, const char *path, int flags), (dirfd, path, flags))
+WRAP(int, mkdirat, (int dirfd, const char *path, mode_t mode), (dirfd, path, mode))
+WRAP(int, fchmod, (int fd, mode_t mode), (fd, mode))
+WRAP(int, futimens, (int fd, const struct timespec *times), (fd, times))
+WRAP(long, syscall, (long n, long a1, long a2, long a3, long a4, long a5, long a6),
+     (n, a1, a2, a3, a4, a5, a6))
+
+// 4 KiB to 4 GiB; MV_BENCH_MAX_SIZE (in bytes) cuts the sweep short
+static const int64_t sizes[] = {
+    4 << 10, 64 << 10, 1 << 20, 16 << 20, 256 << 20, 1LL << 30, 4LL << 30
+};
+
+static void create_original(int64_t size)
+{
+    std::vector<char> buffer(1 << 20);
+    FILE *fp;
+
+    for (size_t i = 0; i < buffer.size(); i++)
+        buffer[i] = (char) (i * 131 + (i >> 12));
+
+    fp = fopen(original, "wb");
+    for (int64_t done = 0; fp != nullptr && done < size; done += buffer.size()) {
+        fwrite(buffer.data(), 1, std::min((int64_t) buffer.size(), size - done), fp);
+    }
+    if (fp != nullptr) {
+        fflush(fp);
+        fsync(fileno(fp));
+        fclose(fp);
+    }
+}
+
+static double cpu_ms(const struct timeval &tv)
+{
+    return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+// Move a fresh hard link to the original to dest on every iteration, since
+// mv removes its source, and count what the moves cost
+static void run_moves(benchmark::State &state, const char *dest, bool cold)
+{
+    const char *argv[] = {"mv", source, dest, nullptr};
+    struct rusage before, after;
+    double user = 0, sys = 0;
+    long calls = 0;
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        remove(dest);
+        link(original, source);
+        if (cold) {
+            int fd = open(original, O_RDONLY);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+        syscalls = 0;
+        getrusage(RUSAGE_SELF, &before);
+        state.ResumeTiming();
+
+        if (mv_main(3, const_cast<char **>(argv)) != 0) {
+            state.SkipWithError("mv failed");
+            break;
+        }
+        getrusage(RUSAGE_SELF, &after);
+        calls += syscalls;
+        user += cpu_ms(after.ru_utime) - cpu_ms(before.ru_utime);
+        sys += cpu_ms(after.ru_stime) - cpu_ms(before.ru_stime);
+    }
+
+    state.counters["syscalls"] = benchmark::Counter(calls, benchmark::Counter::kAvgIterations);
+    state.counters["user_ms"] = benchmark::Counter(user, benchmark::Counter::kAvgIterations);
+    state.counters["sys_ms"] = benchmark::Counter(sys, benchmark::Counter::kAvgIterations);
+    remove(source);
+    remove(dest);
+}
+
+// A move within the file system is a rename(), whatever the file size, so
+// it is timed once and without a throughput
+static void BM_Rename(benchmark::State &state)
+{
+    create_original(4 << 10);
+    run_moves(state, destination, false);
+    remove(original);
+}
+
+// Args: file size, 1 to start every move with a cold page cache. The
+// destination is on the tmpfs at /dev/shm, so mv has to copy the data.
+static void BM_MoveAcrossDevices(benchmark::State &state)
+{
+    int64_t size = state.range(0);
+    struct stat st_here, st_shm;
+
+    if (stat(".", &st_here) != 0 || stat("/dev/shm", &st_shm) != 0 ||
+        st_here.st_dev == st_shm.st_dev) {
+        state.SkipWithError("no tmpfs on another device at /dev/shm");
+        return;
+    }
+
+    create_original(size);
+    run_moves(state, shm_destination, state.range(1) != 0);
+
+    state.SetBytesProcessed(int64_t(state.iterations()) * size);
+    state.counters["MB/s"] = benchmark::Counter(double(state.iterations()) * size / 1e6,
+                                                benchmark::Counter::kIsRate);
+    remove(original);
+}
+
+static int register_benchmarks()
+{
+    const char *max = getenv("MV_BENCH_MAX_SIZE");
+    int64_t max_size = (max != nullptr) ? strtoll(max, nullptr, 10) : sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+
+    benchmark::RegisterBenchmark("BM_Rename", BM_Rename)
+        ->Unit(benchmark::kMicrosecond)->UseRealTime()->MeasureProcessCPUTime();
+    for (int64_t size : sizes) {
+        if (size > max_size)
+            break;
+        benchmark::RegisterBenchmark("BM_MoveAcrossDevices", BM_MoveAcrossDevices)
+            ->ArgNames({"size", "cold"})
+            ->Args({size, 0})->Args({size, 1})
+            ->Unit(benchmark::kMillisecond)->UseRealTime()->MeasureProcessCPUTime();
+    }
+    return 0;
+}
+
+static int registered = register_benchmarks();
+
+BENCHMARK_MAIN();
@@ -1,51 +1,692 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #define BUFSIZE 1024
+#define URING_BUFSIZE (256 << 10) // size of each registered io_uring buffer
+#define URING_DEPTH 16          // number of chunks in flight
+#define STATS_BUCKETS 32        // latency histogram buckets, powers of two from 1 us
 
-int mv_main(int argc, char *argv[])
+// Result of a copy attempt
+#define COPY_DONE      0
+#define COPY_ERROR    -1
+#define COPY_FALLBACK  1        // not supported here, use the read()/write() loop
+
+// How a move got done, reported by --stats
+typedef enum {
+    METHOD_RENAME,
+    METHOD_IO_URING,
+    METHOD_READ_WRITE,
+    METHOD_COUNT
+} MoveMethod;
+
+static const char *method_names[METHOD_COUNT] = {"rename", "io_uring", "read/write"};
+
+// What a move did, for --stats
+struct move_totals {
+    unsigned int methods;       // bit per MoveMethod
+    unsigned long long files;
+    unsigned long long bytes;
+};
+
+/*
+ * --stats: the same counters as cp --stats, for the reads and writes of the
+ * data. mv is single threaded, so they are plain globals.
+ */
+
+typedef enum {
+    CALL_READ,
+    CALL_WRITE,
+    CALL_KINDS
+} CallKind;
+
+static const char *call_names[CALL_KINDS] = {"read", "write"};
+
+struct call_stats {
+    unsigned long long calls;
+    unsigned long long short_calls;     // moved less than asked for, but not nothing
+    unsigned long long bytes;
+    unsigned long long ns;
+    unsigned long long latency[STATS_BUCKETS]; // bucket i: less than 2^i us
+};
+
+static struct call_stats stats[CALL_KINDS];
+static int report_stats;
+
+static long long now_ns(void)
 {
+    struct timespec ts;
 
-    if (argc != 3) {
-        write(STDERR_FILENO, "Usage: mv <source> <destination>\n", 34);
-        return 1;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long stats_begin(void)
+{
+    return report_stats ? now_ns() : 0;
+}
+
+static void stats_record(CallKind kind, long long ns, ssize_t n, size_t want)
+{
+    struct call_stats *cs = &stats[kind];
+    int bucket = 0;
+
+    if (!report_stats)
+        return;
+
+    while (bucket < STATS_BUCKETS - 1 && ns >= 1000LL << bucket)
+        bucket++;
+
+    cs->calls++;
+    if (n > 0 && (size_t) n < want)
+        cs->short_calls++;
+    if (n > 0)
+        cs->bytes += n;
+    cs->ns += ns;
+    cs->latency[bucket]++;
+}
+
+static ssize_t stats_pread(int fd, void *buffer, size_t len, off_t offset)
+{
+    long long start = stats_begin();
+    ssize_t n = pread(fd, buffer, len, offset);
+
+    if (report_stats)
+        stats_record(CALL_READ, now_ns() - start, n, len);
+    return n;
+}
+
+static ssize_t stats_pwrite(int fd, const void *buffer, size_t len, off_t offset)
+{
+    long long start = stats_begin();
+    ssize_t n = pwrite(fd, buffer, len, offset);
+
+    if (report_stats)
+        stats_record(CALL_WRITE, now_ns() - start, n, len);
+    return n;
+}
+
+static ssize_t stats_read(int fd, void *buffer, size_t len)
+{
+    long long start = stats_begin();
+    ssize_t n = read(fd, buffer, len);
+
+    if (report_stats)
+        stats_record(CALL_READ, now_ns() - start, n, len);
+    return n;
+}
+
+static ssize_t stats_write(int fd, const void *buffer, size_t len)
+{
+    long long start = stats_begin();
+    ssize_t n = write(fd, buffer, len);
+
+    if (report_stats)
+        stats_record(CALL_WRITE, now_ns() - start, n, len);
+    return n;
+}
+
+/*
+ * io_uring copy, on raw system calls so liburing is not needed. It is the
+ * same pipeline as the io_uring strategy of cp: each slot owns a registered
+ * buffer and carries one chunk as a READ_FIXED linked to a WRITE_FIXED, and
+ * takes the next chunk when its write completes.
+ */
+
+struct uring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned to_submit;
+};
+
+struct uring_slot {
+    char *buffer;
+    off_t offset;           // offset of the chunk in both files
+    size_t len;
+    int read_res;
+    long long queued;       // when the read (then the write) started, for --stats
+};
+
+static int uring_setup(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+        return -1;
+
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) ((char *) ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) ((char *) ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown(struct uring *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+}
+
+static void uring_queue(struct uring *ring, int opcode, int fd, struct uring_slot *slot,
+                        int buf_index, unsigned flags, __u64 user_data)
+{
+    unsigned tail = *ring->sq_tail;     // only we write the tail
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = flags;
+    sqe->fd = fd;
+    sqe->addr = (__u64) (unsigned long) slot->buffer;
+    sqe->len = slot->len;
+    sqe->off = slot->offset;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+static int uring_enter(struct uring *ring, unsigned min_complete)
+{
+    int ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        return -1;
+    ring->to_submit -= ret;
+    return 0;
+}
+
+static void uring_queue_slot(struct uring *ring, int fd_src, int fd_dest,
+                             struct uring_slot *slots, struct uring_slot *slot)
+{
+    int i = slot - slots;
+
+    slot->read_res = -ECANCELED;
+    slot->queued = stats_begin();
+    uring_queue(ring, IORING_OP_READ_FIXED, fd_src, slot, i, IOSQE_IO_LINK, 2 * i);
+    uring_queue(ring, IORING_OP_WRITE_FIXED, fd_dest, slot, i, 0, 2 * i + 1);
+}
+
+// Copy a chunk whose linked read and write did not both complete in full
+static int uring_finish_slot(int fd_src, int fd_dest, struct uring_slot *slot)
+{
+    size_t done = 0;
+
+    if (slot->read_res < 0 && slot->read_res != -ECANCELED &&
+        slot->read_res != -EINVAL && slot->read_res != -EOPNOTSUPP) {
+        errno = -slot->read_res;
+        return -1;
+    }
+
+    // Whatever was read is still in the buffer
+    if (slot->read_res > 0) {
+        done = slot->read_res;
+        if (stats_pwrite(fd_dest, slot->buffer, done, slot->offset) != (ssize_t) done)
+            return -1;
+    }
+
+    while (done < slot->len) {
+        ssize_t n = stats_pread(fd_src, slot->buffer, slot->len - done, slot->offset + done);
+        if (n <= 0)
+            return (n == 0) ? 0 : -1;
+        if (stats_pwrite(fd_dest, slot->buffer, n, slot->offset + done) != n)
+            return -1;
+        done += n;
+    }
+
+    return 0;
+}
+
+static int copy_uring(int fd_src, int fd_dest)
+{
+    struct uring_slot slots[URING_DEPTH];
+    struct iovec iovecs[URING_DEPTH];
+    struct uring ring;
+    struct stat st;
+    off_t next = 0;
+    unsigned depth = URING_DEPTH, i;
+    unsigned outstanding = 0;       // submitted requests without a completion
+    char *buffers;
+    int failed = 0;
+
+    if (fstat(fd_src, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return COPY_FALLBACK;
+
+    // No point in setting up more buffers than there are chunks
+    if ((off_t) depth * URING_BUFSIZE > st.st_size)
+        depth = (st.st_size + URING_BUFSIZE - 1) / URING_BUFSIZE;
+
+    // Old kernels, seccomp filters and kernel.io_uring_disabled land here
+    if (uring_setup(&ring, 2 * depth) < 0) {
+        uring_teardown(&ring);
+        return COPY_FALLBACK;
+    }
+
+    if (posix_memalign((void **) &buffers, sysconf(_SC_PAGESIZE), depth * URING_BUFSIZE) != 0) {
+        uring_teardown(&ring);
+        return COPY_FALLBACK;
+    }
+    for (i = 0; i < depth; i++) {
+        slots[i].buffer = buffers + i * URING_BUFSIZE;
+        iovecs[i].iov_base = slots[i].buffer;
+        iovecs[i].iov_len = URING_BUFSIZE;
+    }
+
+    // Registering can fail on a low RLIMIT_MEMLOCK
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iovecs, depth) < 0) {
+        uring_teardown(&ring);
+        free(buffers);
+        return COPY_FALLBACK;
+    }
+
+    for (i = 0; i < depth && next < st.st_size; i++) {
+        slots[i].offset = next;
+        slots[i].len = (st.st_size - next < URING_BUFSIZE) ? st.st_size - next : URING_BUFSIZE;
+        next += slots[i].len;
+        uring_queue_slot(&ring, fd_src, fd_dest, slots, &slots[i]);
+        outstanding += 2;
+    }
+
+    while (outstanding > 0) {
+        unsigned head, tail;
+
+        if (uring_enter(&ring, 1) < 0) {
+            failed = 1;
+            break;
+        }
+
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            struct uring_slot *slot = &slots[cqe->user_data / 2];
+
+            outstanding--;
+
+            // Latencies are as seen from here, so they include waiting to be reaped
+            if (report_stats) {
+                long long now = now_ns();
+                stats_record((cqe->user_data % 2 == 0) ? CALL_READ : CALL_WRITE,
+                             now - slot->queued, cqe->res, slot->len);
+                slot->queued = now;
+            }
+
+            if (cqe->user_data % 2 == 0) {
+                slot->read_res = cqe->res;
+                continue;
+            }
+
+            if ((cqe->res < 0 || (size_t) cqe->res != slot->len) &&
+                uring_finish_slot(fd_src, fd_dest, slot) < 0)
+                failed = 1;
+
+            // After a failure only drain what is in flight
+            if (!failed && next < st.st_size) {
+                slot->offset = next;
+                slot->len = (st.st_size - next < URING_BUFSIZE) ? st.st_size - next : URING_BUFSIZE;
+                next += slot->len;
+                uring_queue_slot(&ring, fd_src, fd_dest, slots, slot);
+                outstanding += 2;
+            }
+        }
+
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
     }
 
-    int fd_src, fd_dest;
+    uring_teardown(&ring);
+
+    // If we could not wait for the kernel it may still use the buffers
+    if (outstanding == 0)
+        free(buffers);
+
+    return failed ? COPY_ERROR : COPY_DONE;
+}
+
+static int copy_read_write(int fd_src, int fd_dest)
+{
     char buffer[BUFSIZE];
     ssize_t bytes_read, bytes_written;
 
-    fd_src = open(argv[1], O_RDONLY);
-    if (fd_src < 0) {
-        return 1;
+    while ((bytes_read = stats_read(fd_src, buffer, sizeof(buffer))) > 0) {
+        bytes_written = stats_write(fd_dest, buffer, bytes_read);
+        if (bytes_written != bytes_read) {
+            return COPY_ERROR;
+        }
     }
 
-    fd_dest = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return (bytes_read < 0) ? COPY_ERROR : COPY_DONE;
+}
+
+/*
+ * Moves across file systems. rename() only works within one, so anything
+ * else is copied, data, mode and times, and the source removed once the
+ * whole copy is done, so a failure half way leaves the source complete.
+ */
+
+// Copy the regular file src_name to dest_name (relative to their dirfds)
+static int copy_file_at(int src_dirfd, const char *src_name, int dest_dirfd, const char *dest_name,
+                        const struct stat *st, struct move_totals *totals)
+{
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    int fd_src, fd_dest, ret;
+
+    fd_src = openat(src_dirfd, src_name, O_RDONLY);
+    if (fd_src < 0)
+        return -1;
+
+    fd_dest = openat(dest_dirfd, dest_name, O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 07777);
     if (fd_dest < 0) {
         close(fd_src);
+        return -1;
+    }
+
+    ret = copy_uring(fd_src, fd_dest);
+    if (ret == COPY_FALLBACK) {
+        totals->methods |= 1u << METHOD_READ_WRITE;
+        ret = copy_read_write(fd_src, fd_dest);
+    } else {
+        totals->methods |= 1u << METHOD_IO_URING;
+    }
+
+    // The mode given to open() went through the umask, or the file existed
+    if (ret == COPY_DONE && (fchmod(fd_dest, st->st_mode & 07777) < 0 ||
+                             futimens(fd_dest, times) < 0))
+        ret = COPY_ERROR;
+
+    if (ret == COPY_DONE) {
+        totals->files++;
+        totals->bytes += st->st_size;
+    }
+
+    close(fd_src);
+    close(fd_dest);
+    return (ret == COPY_DONE) ? 0 : -1;
+}
+
+// Copy a file, symbolic link, special file or whole directory tree
+static int copy_entry(int src_dirfd, const char *src_name, int dest_dirfd, const char *dest_name,
+                      struct move_totals *totals)
+{
+    struct timespec times[2];
+    struct dirent *entry;
+    struct stat st;
+    int src_fd, dest_fd, ret = 0;
+    DIR *dir;
+
+    if (fstatat(src_dirfd, src_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return -1;
+
+    if (S_ISREG(st.st_mode))
+        return copy_file_at(src_dirfd, src_name, dest_dirfd, dest_name, &st, totals);
+
+    if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t len = readlinkat(src_dirfd, src_name, target, sizeof(target) - 1);
+
+        if (len < 0)
+            return -1;
+        target[len] = '\0';
+        if (symlinkat(target, dest_dirfd, dest_name) < 0 &&
+            (errno != EEXIST || unlinkat(dest_dirfd, dest_name, 0) < 0 ||
+             symlinkat(target, dest_dirfd, dest_name) < 0))
+            return -1;
+        totals->files++;
+        return 0;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        if (mknodat(dest_dirfd, dest_name, st.st_mode, st.st_rdev) < 0)
+            return -1;
+        totals->files++;
+        return 0;
+    }
+
+    // Writable until the entries are in, the real mode comes last
+    if (mkdirat(dest_dirfd, dest_name, S_IRWXU) < 0 && errno != EEXIST)
+        return -1;
+
+    src_fd = openat(src_dirfd, src_name, O_RDONLY | O_DIRECTORY);
+    dest_fd = openat(dest_dirfd, dest_name, O_RDONLY | O_DIRECTORY);
+    dir = (src_fd >= 0) ? fdopendir(src_fd) : NULL;
+    if (dir == NULL || dest_fd < 0) {
+        if (dir == NULL && src_fd >= 0)
+            close(src_fd);
+        if (dir != NULL)
+            closedir(dir);
+        if (dest_fd >= 0)
+            close(dest_fd);
+        return -1;
+    }
+
+    while (ret == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            ret = copy_entry(dirfd(dir), entry->d_name, dest_fd, entry->d_name, totals);
+    }
+
+    // Copying the entries changed the mtime of the directory, so times go last
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    if (ret == 0 && (fchmod(dest_fd, st.st_mode & 07777) < 0 || futimens(dest_fd, times) < 0))
+        ret = -1;
+
+    closedir(dir);
+    close(dest_fd);
+    return ret;
+}
+
+// Remove name and, for a directory, everything in it
+static int remove_entry(int dirfd, const char *name)
+{
+    struct dirent *entry;
+    struct stat st;
+    int fd, ret = 0;
+    DIR *dir;
+
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return -1;
+    if (!S_ISDIR(st.st_mode))
+        return unlinkat(dirfd, name, 0);
+
+    fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+    dir = (fd >= 0) ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    while (ret == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            ret = remove_entry(fd, entry->d_name);
+    }
+    closedir(dir);
+
+    return (ret == 0) ? unlinkat(dirfd, name, AT_REMOVEDIR) : -1;
+}
+
+// Write the --stats counters as one line of JSON, like cp --stats
+static void print_stats(const char *stats_file, const struct move_totals *totals, long long elapsed)
+{
+    const char *sep = "";
+    FILE *out = stderr;
+
+    if (stats_file != NULL && (out = fopen(stats_file, "w")) == NULL) {
+        fprintf(stderr, "mv: cannot write stats to '%s': %s\n", stats_file, strerror(errno));
+        return;
+    }
+
+    fprintf(out, "{\"tool\": \"mv\", \"methods\": [");
+    for (int i = 0; i < METHOD_COUNT; i++) {
+        if (totals->methods & (1u << i)) {
+            fprintf(out, "%s\"%s\"", sep, method_names[i]);
+            sep = ", ";
+        }
+    }
+    fprintf(out, "], \"files\": %llu, \"bytes\": %llu, \"elapsed_ns\": %lld, \"mb_per_s\": %.1f",
+            totals->files, totals->bytes, elapsed,
+            elapsed > 0 ? totals->bytes * 1e3 / elapsed : 0.0);
+
+    for (int kind = 0; kind < CALL_KINDS; kind++) {
+        const struct call_stats *cs = &stats[kind];
+
+        sep = "";
+
+        fprintf(out, ", \"%s\": {\"calls\": %llu, \"short\": %llu, \"bytes\": %llu, "
+                "\"time_ns\": %llu, \"latency_us\": {", call_names[kind],
+                cs->calls, cs->short_calls, cs->bytes, cs->ns);
+        for (int i = 0; i < STATS_BUCKETS; i++) {
+            if (cs->latency[i] > 0) {
+                fprintf(out, "%s\"%llu\": %llu", sep, 1ULL << i, cs->latency[i]);
+                sep = ", ";
+            }
+        }
+        fprintf(out, "}}");
+    }
+    fprintf(out, "}\n");
+
+    if (out != stderr)
+        fclose(out);
+}
+
+int mv_main(int argc, char *argv[])
+{
+    static const char usage[] = "Usage: mv [--stats[=FILE]] <source> <destination>\n";
+    struct move_totals totals = { 0, 0, 0 };
+    const char *stats_file = NULL;
+    const char *source, *destination;
+    char path[PATH_MAX];
+    long long start = now_ns();
+    struct stat st, st_dest;
+    int existed;
+
+    report_stats = 0;
+    memset(stats, 0, sizeof(stats));
+
+    if (argc == 4 && strncmp(argv[1], "--stats", 7) == 0 &&
+        (argv[1][7] == '\0' || argv[1][7] == '=')) {
+        report_stats = 1;
+        stats_file = (argv[1][7] == '=') ? argv[1] + 8 : NULL;
+        argv++;
+        argc--;
+    }
+
+    if (argc != 3) {
+        write(STDERR_FILENO, usage, sizeof(usage) - 1);
         return 1;
     }
+    source = argv[1];
+    destination = argv[2];
 
-    while ((bytes_read = read(fd_src, buffer, sizeof(buffer))) > 0) {
-        bytes_written = write(fd_dest, buffer, bytes_read);
-        if (bytes_written != bytes_read) {
-            close(fd_src);
-            close(fd_dest);
+    if (lstat(source, &st) < 0) {
+        fprintf(stderr, "mv: cannot stat '%s': %s\n", source, strerror(errno));
+        return 1;
+    }
+
+    // Like mv(1): moving onto a directory moves into it
+    if (stat(destination, &st_dest) == 0 && S_ISDIR(st_dest.st_mode)) {
+        const char *end = source + strlen(source), *name;
+
+        while (end > source + 1 && end[-1] == '/')
+            end--;
+        for (name = end; name > source && name[-1] != '/'; name--)
+            ;
+        if (snprintf(path, sizeof(path), "%s/%.*s", destination, (int) (end - name), name) >=
+            (int) sizeof(path)) {
+            fprintf(stderr, "mv: '%s': %s\n", destination, strerror(ENAMETOOLONG));
             return 1;
         }
+        destination = path;
     }
 
-    if (bytes_read < 0) {
-        close(fd_src);
-        close(fd_dest);
+    // Like mv(1), never replace a directory with a non-directory or the
+    // other way round
+    existed = lstat(destination, &st_dest) == 0;
+    if (existed && S_ISDIR(st.st_mode) && !S_ISDIR(st_dest.st_mode)) {
+        fprintf(stderr, "mv: cannot overwrite non-directory '%s' with directory '%s'\n",
+                destination, source);
+        return 1;
+    }
+    if (existed && !S_ISDIR(st.st_mode) && S_ISDIR(st_dest.st_mode)) {
+        fprintf(stderr, "mv: cannot overwrite directory '%s' with non-directory '%s'\n",
+                destination, source);
         return 1;
     }
 
-    close(fd_src);
-    close(fd_dest);
+    // Within a file system a move is one metadata update, whatever the size
+    if (rename(source, destination) == 0) {
+        totals.methods |= 1u << METHOD_RENAME;
+        totals.files = 1;
+        totals.bytes = S_ISREG(st.st_mode) ? st.st_size : 0;
+    } else if (errno != EXDEV) {
+        fprintf(stderr, "mv: cannot move '%s' to '%s': %s\n", source, destination, strerror(errno));
+        return 1;
+    } else if (copy_entry(AT_FDCWD, source, AT_FDCWD, destination, &totals) < 0) {
+        int err = errno;
+
+        // The source is still whole, so don't leave half a copy behind. What
+        // was there before the move is not ours to remove.
+        if (!existed)
+            remove_entry(AT_FDCWD, destination);
+        fprintf(stderr, "mv: cannot copy '%s' to '%s': %s\n", source, destination, strerror(err));
+        return 1;
+    } else if (remove_entry(AT_FDCWD, source) < 0) {
+        fprintf(stderr, "mv: cannot remove '%s': %s\n", source, strerror(errno));
+        return 1;
+    }
 
-    // Remove source file
-    unlink(argv[1]);
+    if (report_stats)
+        print_stats(stats_file, &totals, now_ns() - start);
 
     return 0;
 }
@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 
 extern "C" int mv_main(int argc, char *argv[]);
@@ -53,6 +54,7 @@ protected:
             exit(EXIT_FAILURE);
         }
 
+        fflush(stdout); // Don't let the child flush our buffered output into the pipe
         pid = fork();
         if (pid == -1) {
             perror("fork");
@@ -69,7 +71,7 @@ protected:
             exit(mv_main(argc, argv));
         } else { // Parent process
             close(pipefd[1]); // Close unused write end
-            wait(&status); // Wait for child process to finish
+            waitpid(pid, &status, 0); // Wait for child process to finish
 
             ssize_t n;
             while ((n = read(pipefd[0], buffer, sizeof(buffer) - 1)) > 0) {
@@ -235,3 +237,175 @@ TEST_F(MvTest, MoveLargeFile) {
     remove(destination);
 }
 
+
+TEST_F(MvTest, MoveWithStats) {
+    const char *source = "stats_source.txt";
+    const char *destination = "stats_destination.txt";
+    std::string content(1000000, 's');
+
+    create_file(source, content.c_str());
+
+    const char *argv[] = {"mv", "--stats", source, destination, NULL};
+    int argc = 4;
+
+    auto result_status = run_mv_command(argc, const_cast<char**>(argv));
+    std::string result = result_status.first;
+
+    ASSERT_EQ(result_status.second, 0) << "mv program should return 0 on success.";
+    ASSERT_NE(result.find("{\"tool\": \"mv\""), std::string::npos) << "The stats should be printed as JSON: " << result;
+    ASSERT_NE(result.find("\"bytes\": 1000000,"), std::string::npos) << result;
+    ASSERT_NE(result.find("\"write\": {\"calls\": "), std::string::npos) << result;
+    ASSERT_STREQ(content.c_str(), read_file(destination).c_str());
+    ASSERT_EQ(access(source, F_OK), -1) << "The source file should be deleted after a successful move.";
+
+    // Clean up
+    remove(destination);
+}
+
+TEST_F(MvTest, MoveIsRename) {
+    const char *source = "rename_source.txt";
+    const char *destination = "rename_destination.txt";
+    struct stat st_before, st_after;
+
+    create_file(source, "Renamed, not copied.");
+    ASSERT_EQ(stat(source, &st_before), 0);
+
+    const char *argv[] = {"mv", "--stats", source, destination, NULL};
+    auto result_status = run_mv_command(4, const_cast<char**>(argv));
+
+    ASSERT_EQ(result_status.second, 0) << "mv program should return 0 on success.";
+    ASSERT_NE(result_status.first.find("\"methods\": [\"rename\"]"), std::string::npos) << result_status.first;
+    ASSERT_EQ(stat(destination, &st_after), 0);
+    ASSERT_EQ(st_before.st_ino, st_after.st_ino) << "A move within a file system should keep the inode.";
+    ASSERT_EQ(access(source, F_OK), -1);
+
+    // Moving a file onto itself must not lose it
+    const char *argv_self[] = {"mv", destination, destination, NULL};
+    result_status = run_mv_command(3, const_cast<char**>(argv_self));
+    ASSERT_EQ(result_status.second, 0);
+    ASSERT_STREQ("Renamed, not copied.", read_file(destination).c_str());
+
+    // Clean up
+    remove(destination);
+}
+
+TEST_F(MvTest, MoveDirectory) {
+    system("rm -rf dir_source dir_destination dir_target");
+    ASSERT_EQ(mkdir("dir_source", 0755), 0);
+    ASSERT_EQ(mkdir("dir_source/sub", 0700), 0);
+    create_file("dir_source/sub/file.txt", "Nested file.");
+    ASSERT_EQ(symlink("sub/file.txt", "dir_source/link"), 0);
+
+    const char *argv[] = {"mv", "dir_source", "dir_destination", NULL};
+    auto result_status = run_mv_command(3, const_cast<char**>(argv));
+
+    ASSERT_EQ(result_status.second, 0) << "mv should move directories.";
+    ASSERT_EQ(access("dir_source", F_OK), -1);
+    ASSERT_STREQ("Nested file.", read_file("dir_destination/link").c_str());
+
+    // An existing directory as the destination receives the source
+    ASSERT_EQ(mkdir("dir_target", 0755), 0);
+    const char *argv_into[] = {"mv", "dir_destination/", "dir_target", NULL};
+    result_status = run_mv_command(3, const_cast<char**>(argv_into));
+    ASSERT_EQ(result_status.second, 0);
+    ASSERT_STREQ("Nested file.", read_file("dir_target/dir_destination/sub/file.txt").c_str());
+
+    // A directory never replaces a file, nor a file a directory
+    create_file("dir_destination", "Existing file.");
+    const char *argv_over[] = {"mv", "dir_target", "dir_destination", NULL};
+    result_status = run_mv_command(3, const_cast<char**>(argv_over));
+    ASSERT_NE(result_status.second, 0);
+    ASSERT_STREQ("Existing file.", read_file("dir_destination").c_str());
+    ASSERT_EQ(access("dir_target/dir_destination/link", F_OK), 0);
+
+    const char *argv_under[] = {"mv", "dir_destination", "dir_target", NULL};
+    result_status = run_mv_command(3, const_cast<char**>(argv_under));
+    ASSERT_NE(result_status.second, 0);
+    ASSERT_STREQ("Existing file.", read_file("dir_destination").c_str());
+
+    // Clean up
+    system("rm -rf dir_source dir_destination dir_target");
+}
+
+TEST_F(MvTest, MoveAcrossFileSystems) {
+    struct stat st_shm, st_here, st;
+
+    if (stat("/dev/shm", &st_shm) != 0 || stat(".", &st_here) != 0 || st_shm.st_dev == st_here.st_dev)
+        GTEST_SKIP() << "No tmpfs on another device at /dev/shm";
+
+    std::string content(3000000, 'x');
+    struct timespec old_times[2] = {{1000000000, 0}, {1000000000, 0}};
+
+    system("rm -rf /dev/shm/mv_cross_file /dev/shm/mv_cross_dir cross_file cross_dir");
+    create_file("/dev/shm/mv_cross_file", content.c_str());
+    ASSERT_EQ(chmod("/dev/shm/mv_cross_file", 0640), 0);
+    ASSERT_EQ(utimensat(AT_FDCWD, "/dev/shm/mv_cross_file", old_times, 0), 0);
+
+    // A file is copied, with its mode and times, then the source removed
+    const char *argv[] = {"mv", "--stats", "/dev/shm/mv_cross_file", "cross_file", NULL};
+    auto result_status = run_mv_command(4, const_cast<char**>(argv));
+    ASSERT_EQ(result_status.second, 0) << "mv should fall back to a copy across file systems.";
+    ASSERT_EQ(result_status.first.find("rename"), std::string::npos) << result_status.first;
+    ASSERT_NE(result_status.first.find("\"bytes\": 3000000,"), std::string::npos) << result_status.first;
+    ASSERT_STREQ(content.c_str(), read_file("cross_file").c_str());
+    ASSERT_EQ(stat("cross_file", &st), 0);
+    ASSERT_EQ(st.st_mode & 07777, 0640u);
+    ASSERT_EQ(st.st_mtim.tv_sec, 1000000000);
+    ASSERT_EQ(access("/dev/shm/mv_cross_file", F_OK), -1);
+
+    // So is a directory tree
+    ASSERT_EQ(mkdir("/dev/shm/mv_cross_dir", 0755), 0);
+    ASSERT_EQ(mkdir("/dev/shm/mv_cross_dir/sub", 0750), 0);
+    create_file("/dev/shm/mv_cross_dir/sub/file.txt", "Across.");
+    ASSERT_EQ(symlink("sub/file.txt", "/dev/shm/mv_cross_dir/link"), 0);
+
+    const char *argv_dir[] = {"mv", "/dev/shm/mv_cross_dir", "cross_dir", NULL};
+    result_status = run_mv_command(3, const_cast<char**>(argv_dir));
+    ASSERT_EQ(result_status.second, 0);
+    ASSERT_STREQ("Across.", read_file("cross_dir/link").c_str());
+    ASSERT_EQ(stat("cross_dir/sub", &st), 0);
+    ASSERT_EQ(st.st_mode & 07777, 0750u);
+    ASSERT_EQ(access("/dev/shm/mv_cross_dir", F_OK), -1);
+
+    // A file that is in the way is an error, and is kept
+    ASSERT_EQ(mkdir("/dev/shm/mv_cross_dir", 0755), 0);
+    create_file("cross_partial", "Existing file.");
+    const char *argv_over[] = {"mv", "/dev/shm/mv_cross_dir", "cross_partial", NULL};
+    result_status = run_mv_command(3, const_cast<char**>(argv_over));
+    ASSERT_NE(result_status.second, 0);
+    ASSERT_STREQ("Existing file.", read_file("cross_partial").c_str());
+    ASSERT_EQ(access("/dev/shm/mv_cross_dir", F_OK), 0);
+    ASSERT_EQ(rmdir("/dev/shm/mv_cross_dir"), 0);
+
+    // A copy that fails part way is removed, and the source kept. Writes
+    // past RLIMIT_FSIZE fail with EFBIG once SIGXFSZ is ignored.
+    ASSERT_EQ(mkdir("/dev/shm/mv_cross_dir", 0755), 0);
+    create_file("/dev/shm/mv_cross_dir/a_small.txt", "Small.");
+    create_file("/dev/shm/mv_cross_dir/big.bin", content.c_str());
+    create_file("/dev/shm/mv_cross_file", content.c_str());
+
+    for (const char *partial : {"/dev/shm/mv_cross_dir", "/dev/shm/mv_cross_file"}) {
+        system("rm -rf cross_partial");
+        fflush(stdout);
+        pid_t pid = fork();
+        ASSERT_GE(pid, 0);
+        if (pid == 0) {
+            struct rlimit limit = {1 << 20, 1 << 20};
+            signal(SIGXFSZ, SIG_IGN);
+            setrlimit(RLIMIT_FSIZE, &limit);
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, STDERR_FILENO);
+            const char *argv_partial[] = {"mv", partial, "cross_partial", NULL};
+            _exit(mv_main(3, const_cast<char**>(argv_partial)));
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) != 0) << partial << " should fail to move.";
+        ASSERT_EQ(access("cross_partial", F_OK), -1) << "The partial copy of " << partial << " should be removed.";
+        ASSERT_EQ(access(partial, F_OK), 0) << "The source should be kept.";
+    }
+    ASSERT_STREQ(content.c_str(), read_file("/dev/shm/mv_cross_dir/big.bin").c_str());
+
+    // Clean up
+    system("rm -rf cross_file cross_dir cross_partial /dev/shm/mv_cross_dir /dev/shm/mv_cross_file");
+}